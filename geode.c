@@ -7,16 +7,31 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "c.h"
 #include "cpp.h"
 
@@ -27,9 +42,42 @@
 #define QUIT_CONFIRM 1
 
 #define CTRL_KEY(key) ((key) & 0x1f)
-#define ABUF_INIT { NULL, 0 }
+#define ABUF_INIT { NULL, 0, 0 }
+#define ROW_DEPTH 256
+#define ROW_BATCH 4096
+#define HL_CHECKPOINT 256
+#define SLAB_SIZE (64 << 10)
+#define SLAB_CLASSES 16
+#define SLAB_LARGE 255
+#define HL_IDLE_ROWS 65536
+#define HL_THREADS 16
+#define HL_SLICE 65536
+#define LINE_LONG 16384
+#define LINE_CHUNK 4096
+#define LINE_SLACK 64
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+#define CC_SEPARATOR (1 << 0)
+#define CC_OPERATOR (1 << 1)
+#define CELL_INVERSE 0x80
+#define CELL_GAP 4
+#define SGR_ATTRS 18
+#define INPUT_SIZE 4096
+#define PASTE_END "\x1b[201~"
+#define SAVE_IOV 512
+#define SAVE_PROGRESS (16 << 20)
+#define FIND_THREADS 16
+#define FIND_SLICE 65536
+#define FIND_DIRTY 256
+#define RX_INSTS 4096
+#define RX_STATES 2048
+#define RX_HASH 4096
+#define RX_REPEAT 1000
+#define RX_LITERAL 64
+#define RX_AT_BOL (1 << 0)
+#define RX_AT_EOL (1 << 1)
+#define RX_BUDGET 4
+#define RX_BLOCK 4096
 
 enum keys {
   BACKSPACE = 127,
@@ -42,7 +90,8 @@ enum keys {
   HOME,
   END,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE
 };
 
 enum highlights {
@@ -57,6 +106,25 @@ enum highlights {
   HL_MATCH
 };
 
+enum regexNodes {
+  RN_EMPTY,
+  RN_SET,
+  RN_BOL,
+  RN_EOL,
+  RN_CAT,
+  RN_ALT,
+  RN_REPEAT
+};
+
+enum regexOps {
+  RX_SET,
+  RX_BOL,
+  RX_EOL,
+  RX_SPLIT,
+  RX_JUMP,
+  RX_MATCH
+};
+
 //// Variables ////
 
 struct syntax {
@@ -70,39 +138,307 @@ struct syntax {
   int flags;
 };
 
+struct lexeme {
+  char* text;
+  int len;
+  unsigned char hl;
+};
+
+struct lexer {
+  unsigned char charClass[256];
+  struct lexeme* keywords;
+  unsigned char* keywordSeeds;
+  unsigned int keywordMask;
+  unsigned int bucketMask;
+  struct lexeme* operators;
+  int operatorStart[257];
+  int slCommentLen;
+  int mlStartLen;
+  int mlEndLen;
+};
+
 typedef struct erow {
-  int index;
   int size;
-  int rsize;
+  signed char hlEntry;
+  unsigned char hlOpenComment;
+  unsigned char hlInline;
+  unsigned char hlLong;
   char* chars;
-  char* render;
   unsigned char* hl;
-  int hlOpenComment;
 } erow;
 
+struct lexState {
+  int i;
+  int inComment;
+  int inString;
+  int prevSep;
+  int hlEnd;
+  int hlLast;
+};
+
+struct lineChunk {
+  int start;
+  int rx;
+  int lead;
+  int tail;
+  char inString;
+  unsigned char inComment;
+  unsigned char prevSep;
+  unsigned char prevHl;
+};
+
+struct lineIndex {
+  struct lineChunk* chunks;
+  int count;
+  int capacity;
+  int rxValid;
+  int from;
+  int to;
+  unsigned char* runs;
+};
+
+typedef struct rnode {
+  erow row;
+  struct rnode* left;
+  struct rnode* right;
+  unsigned int priority;
+  int count;
+  int refs;
+} rnode;
+
+typedef struct cell {
+  char c[4];
+  unsigned char attr;
+} cell;
+
+struct syntaxSlice {
+  int first;
+  int nrows;
+  unsigned char* states[2];
+  int exit[2];
+  pthread_t thread;
+};
+
+struct saveJob {
+  int fd;
+  char tmp[PATH_MAX];
+  char* filename;
+  rnode* tree;
+  size_t indexed;
+  size_t needed;
+  size_t total;
+  size_t done;
+  int finished;
+  int dirty;
+  int lost;
+  int truncated;
+  int error;
+  pthread_mutex_t lock;
+};
+
+struct match {
+  int row;
+  int col;
+  int len;
+};
+
+struct hlSpan {
+  int start;
+  int len;
+  unsigned char hl;
+};
+
+struct spanList {
+  struct hlSpan* items;
+  int count;
+  int capacity;
+};
+
+struct matchList {
+  struct match* items;
+  int count;
+  int capacity;
+};
+
+struct findSlice {
+  int first;
+  int nrows;
+  struct matchList list;
+  pthread_t thread;
+};
+
+struct rxNode {
+  int type;
+  struct rxNode* l;
+  struct rxNode* r;
+  int min, max;
+  unsigned char set[32];
+};
+
+struct rxParser {
+  const char* s;
+  const char* error;
+};
+
+struct rxInst {
+  int op;
+  int x, y;
+  unsigned char set[32];
+};
+
+struct regex {
+  struct rxInst* prog;
+  int n;
+  const char* error;
+  char literal[RX_LITERAL];
+  int literalLen;
+};
+
+struct dfaState {
+  int* pcs;
+  int n;
+  int match;
+  int matchAtEnd;
+  int next[256];
+};
+
+struct dfa {
+  struct regex* re;
+  int unanchored;
+  struct dfaState* states;
+  int nstates;
+  int capacity;
+  int table[RX_HASH];
+  int start[2];
+  int flushes;
+  int* mark;
+  int* work;
+  int generation;
+  int nwork;
+};
+
+struct rxMatcher {
+  struct regex* re;
+  struct dfa anchored;
+  struct dfa search;
+  int nullable;
+  char* text;
+  int len;
+  int budget;
+  int scanFrom;
+  int block;
+  int blockSize;
+  int* longest[2];
+  int* ends;
+  int* saved;
+  size_t savedCapacity;
+};
+
+struct searchIndex {
+  char* query;
+  int regex;
+  struct regex re;
+  struct matchList list;
+  int dirty[FIND_DIRTY];
+  int ndirty;
+  int stale;
+};
+
+struct slabClass {
+  char* free;
+  char* next;
+  char* end;
+};
+
+struct arena {
+  struct slabClass classes[SLAB_CLASSES];
+  char** slabs;
+  int nslabs;
+  int capacity;
+};
+
+struct riter {
+  rnode* stack[ROW_DEPTH];
+  int depth;
+};
+
+struct abuf {
+  char* b;
+  int len;
+  int capacity;
+};
+
+struct sgr {
+  char s[12];
+  int len;
+};
+
 struct config {
   int cx, cy;
   int rx;
   int dx, dy;
   int rows, cols;
   int nrows;
-  erow* row;
+  rnode* tree;
+  char* original;
+  size_t originalSize;
+  int originalMapped;
+  int originalFd;
+  volatile sig_atomic_t originalLost;
+  long pageSize;
+  size_t indexed;
+  size_t nbytes;
+  size_t nchars;
   char* filename;
   int cursor;
   int dirty;
   int insert;
-  char message[80];
+  char message[160];
   time_t cursorTime;
+  time_t clockTime;
   time_t messageTime;
   struct syntax* syntax;
+  struct lexer lexer;
+  unsigned char* checkpoints;
+  int ncheckpoints;
+  int checkpointCapacity;
+  int syntaxFrom;
+  int syntaxPending;
+  int syntaxBarrier;
+  struct spanList spans;
+  cell* screen;
+  cell* frame;
+  int gridRows, gridCols;
+  int gridStale;
+  int termX, termY;
+  int termAttr;
+  int termCursor;
+  int screenDy;
+  struct abuf out;
+  struct abuf pending;
+  int pendingPos;
+  int outfd;
+  int syncOutput;
+  int redraw;
+  int timerfd;
+  int signalfd;
+  int savefd;
+  struct saveJob* save;
+  pthread_t saveThread;
+  struct searchIndex search;
+  struct arena arena;
+  char input[INPUT_SIZE];
+  int inputPos, inputLen;
   struct termios origin;
 };
 struct config E;
 
-struct abuf {
-  char* b;
-  int len;
-};
+// Block sizes of arena size classes, growing by half so that blocks keep
+// headroom for edits without wasting more than a third of their size
+const int slabSizes[SLAB_CLASSES] = { 8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048 };
+
+// Escapes switching between cell attributes, with the changed parameters only
+struct sgr sgrTable[SGR_ATTRS][SGR_ATTRS];
 
 //// Filetypes ////
 
@@ -116,7 +452,19 @@ struct syntax HLDB[] = {
 
 void setStatusMessage(const char* fmt, ...);
 void refreshScreen();
+void scroll();
+void scheduleRefresh();
+void updateWindowSize();
 void refreshConfig();
+void propagateSyntax(int until, int budget);
+void reserveBuffer(struct abuf* ab, int len);
+void appendBuffer(struct abuf* ab, const char* s, int len);
+void freeBuffer(struct abuf* ab);
+void updateSave();
+void freeRow(erow* row);
+int renderWidth(erow* row, int from, int to, int rx);
+void drainOutput();
+void invalidateMatches(int at, int delta);
 char* prompt(char* prompt, void (*callback)(char*, int));
 
 //// Terminal ////
@@ -132,6 +480,8 @@ void throw(const char* s) {
 // Disable raw mode
 void disableRawMode() {
   // Set attribute back to original
+  drainOutput();
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.origin) == -1) throw("tcsetattr");
 }
 
@@ -150,6 +500,55 @@ void enableRawMode() {
   raw.c_cc[VMIN] = 0;
   raw.c_cc[VTIME] = 1;
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) throw("tcsetattr");
+
+  // Enable bracketed paste
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// Open the terminal again for frames to be written without blocking,
+// and ask whether it supports synchronized output
+void setupOutput() {
+  char* tty = ttyname(STDOUT_FILENO);
+  E.outfd = tty ? open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC) : -1;
+  if (E.outfd == -1) E.outfd = STDOUT_FILENO;
+  write(STDOUT_FILENO, "\x1b[?2026$p", 9);
+}
+
+// Check if a frame is still being written
+int outputPending() {
+  return E.pendingPos < E.pending.len;
+}
+
+// Write as much of the pending frame as the terminal takes
+void flushOutput() {
+  while (outputPending()) {
+    int n = write(E.outfd, &E.pending.b[E.pendingPos], E.pending.len - E.pendingPos);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return;
+      throw("write");
+    }
+    E.pendingPos += n;
+  }
+  E.pending.len = E.pendingPos = 0;
+}
+
+// Wait until the pending frame is written
+void drainOutput() {
+  while (outputPending()) {
+    struct pollfd fd = {E.outfd, POLLOUT, 0};
+    if (poll(&fd, 1, -1) == -1 && errno != EINTR) return;
+    flushOutput();
+  }
+}
+
+// Queue frame to be written, keeping its buffer for the next frame
+void queueOutput(int start) {
+  struct abuf frame = E.out;
+  E.out = E.pending;
+  E.pending = frame;
+  E.pendingPos = start;
+  flushOutput();
 }
 
 // Get time
@@ -159,34 +558,169 @@ struct tm* getTime() {
   return localtime(&now);
 }
 
+// Check if input is waiting to be read
+int inputPending() {
+  if (E.inputPos < E.inputLen) return 1;
+  int n = 0;
+  if (ioctl(STDIN_FILENO, FIONREAD, &n) == -1) return 0;
+  return n > 0;
+}
+
+// Setup timer and window size signal descriptors for the event loop
+void setupEvents() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) throw("sigprocmask");
+  if ((E.signalfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) throw("signalfd");
+  if ((E.timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) throw("timerfd_create");
+  if ((E.savefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) throw("eventfd");
+}
+
+// Arm timer for the next cursor blink or minute rollover
+void armTimer() {
+  time_t blink = E.cursorTime + 2;
+  time_t minute = (E.clockTime / 60 + 1) * 60;
+  struct itimerspec its = {{0, 0}, {blink < minute ? blink : minute, 0}};
+  if (timerfd_settime(E.timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) throw("timerfd_settime");
+}
+
+// Wait for events until input is ready, doing idle work in between
+int waitEvents() {
+  // The terminal is watched only while a frame is being written
+  struct pollfd fds[5] = {
+    {STDIN_FILENO, POLLIN, 0},
+    {E.timerfd, POLLIN, 0},
+    {E.signalfd, POLLIN, 0},
+    {E.savefd, POLLIN, 0},
+    {outputPending() ? E.outfd : -1, POLLOUT, 0}
+  };
+  armTimer();
+
+  // Sleep only when highlight propagation has nothing left to do
+  int pending = E.syntaxFrom >= 0;
+  if (poll(fds, 5, pending ? 0 : -1) == -1) {
+    if (errno == EINTR) return 0;
+    throw("poll");
+  }
+
+  if (fds[2].revents & POLLIN) {
+    struct signalfd_siginfo si;
+    while (read(E.signalfd, &si, sizeof(si)) == sizeof(si));
+    updateWindowSize();
+    scheduleRefresh();
+  }
+  if (fds[1].revents & POLLIN) {
+    uint64_t expirations;
+    read(E.timerfd, &expirations, sizeof(expirations));
+  }
+  if (fds[3].revents & POLLIN) {
+    uint64_t done;
+    read(E.savefd, &done, sizeof(done));
+    updateSave();
+  }
+  if (fds[4].revents) flushOutput();
+  refreshConfig();
+
+  if (fds[0].revents & POLLIN) return 1;
+  if (fds[0].revents) throw("poll");
+  if (pending) propagateSyntax(INT_MAX, HL_IDLE_ROWS);
+  return 0;
+}
+
+// Read as much input as is available into the input buffer, waiting
+// briefly when there is none
+int fillInput() {
+  if (E.inputPos > 0) {
+    memmove(E.input, &E.input[E.inputPos], E.inputLen - E.inputPos);
+    E.inputLen -= E.inputPos;
+    E.inputPos = 0;
+  }
+  int nread = read(STDIN_FILENO, &E.input[E.inputLen], INPUT_SIZE - E.inputLen);
+  if (nread == -1 && errno != EAGAIN) throw("read");
+  if (nread > 0) E.inputLen += nread;
+  return nread > 0;
+}
+
+// Read next input byte
+int readByte(char* c) {
+  if (E.inputPos == E.inputLen && !fillInput()) return 0;
+  *c = E.input[E.inputPos++];
+  return 1;
+}
+
+// Read bracketed paste text up to its end marker
+void readPaste(struct abuf* ab) {
+  int matched = 0;
+  int idle = 0;
+  char c;
+  while (matched < (int)strlen(PASTE_END) && idle < 10) {
+    if (!readByte(&c)) {
+      idle++;
+      continue;
+    }
+    idle = 0;
+    if (c == PASTE_END[matched]) {
+      matched++;
+      continue;
+    }
+    if (matched) appendBuffer(ab, PASTE_END, matched);
+    matched = (c == PASTE_END[0]);
+    if (!matched) appendBuffer(ab, &c, 1);
+  }
+}
+
 // Read key from user input
 int readKey() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    refreshConfig();
-    if (nread == -1 && errno != EAGAIN) throw("read");
+  while (E.inputPos == E.inputLen) {
+    // A frame is drawn only once the pending input has been consumed
+    if (E.redraw && !inputPending()) refreshScreen();
+    while (!waitEvents()) {
+      if (E.redraw) refreshScreen();
+    }
+    fillInput();
   }
+  char c = E.input[E.inputPos++];
 
   if (c == '\x1b') {
-    char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    char seq[2];
+    if (!readByte(&seq[0]) || !readByte(&seq[1])) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME;
-            case '2': return INSERT;
-            case '3': return DELETE;
-            case '4': return END;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME;
-            case '8': return END;
+        int n = seq[1] - '0';
+        char d;
+        while (1) {
+          if (!readByte(&d)) return '\x1b';
+          if (d < '0' || d > '9') break;
+          n = n * 10 + d - '0';
+        }
+        if (d == '~') {
+          switch (n) {
+            case 1: return HOME;
+            case 2: return INSERT;
+            case 3: return DELETE;
+            case 4: return END;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME;
+            case 8: return END;
+            case 200: return PASTE;
           }
         }
+      } else if (seq[1] == '?') {
+        // Mode report answering the synchronized output query
+        int mode = 0, value = 0;
+        int* n = &mode;
+        char d;
+        while (1) {
+          if (!readByte(&d)) return '\x1b';
+          if (d >= '0' && d <= '9') *n = *n * 10 + d - '0';
+          else if (d == ';') n = &value;
+          else if (d != '$') break;
+        }
+        if (d == 'y' && mode == 2026) E.syncOutput = (value == 1 || value == 2);
+        return readKey();
       } else {
         switch (seq[1]) {
           case 'A': return ARROW_UP;
@@ -237,64 +771,578 @@ int getWindowSize(int* rows, int* cols) {
   }
 }
 
+// Update editor size from window size
+void updateWindowSize() {
+  if (getWindowSize(&E.rows, &E.cols) == -1) throw("getWindowSize");
+  E.rows -= 2;
+  if (E.rows < 1) E.rows = 1;
+}
+
 // Reset cursor
 void resetCursor() {
   E.cursor = 1;
   E.cursorTime = time(NULL);
-  refreshScreen();
+  scheduleRefresh();
+}
+
+//// Arena ////
+
+// Row text and highlight buffers come from size class slabs. A
+// block starts with one byte holding its class, instead of the larger
+// malloc header, and freed blocks are kept on a list per class. Buffers
+// that grow within their block's class do not move.
+
+// Get size class for block size, or SLAB_LARGE
+int slabClass(size_t size) {
+  for (int c = 0; c < SLAB_CLASSES; c++) {
+    if (size <= (size_t)slabSizes[c]) return c;
+  }
+  return SLAB_LARGE;
+}
+
+// Allocate row buffer
+void* rowAlloc(size_t size) {
+  int c = slabClass(size + 1);
+  char* b;
+  if (c == SLAB_LARGE) {
+    b = malloc(size + 1);
+  } else if (E.arena.classes[c].free) {
+    b = E.arena.classes[c].free;
+    memcpy(&E.arena.classes[c].free, b, sizeof(char*));
+  } else {
+    // Carve blocks from the current slab of the class, or a new slab
+    struct slabClass* sc = &E.arena.classes[c];
+    if (sc->next == NULL || sc->end - sc->next < slabSizes[c]) {
+      if (E.arena.nslabs == E.arena.capacity) {
+        E.arena.capacity = E.arena.capacity ? E.arena.capacity * 2 : 64;
+        E.arena.slabs = realloc(E.arena.slabs, E.arena.capacity * sizeof(char*));
+      }
+      sc->next = E.arena.slabs[E.arena.nslabs++] = malloc(SLAB_SIZE);
+      sc->end = sc->next + SLAB_SIZE;
+    }
+    b = sc->next;
+    sc->next += slabSizes[c];
+  }
+  b[0] = c;
+  return b + 1;
+}
+
+// Free row buffer
+void rowFree(void* p) {
+  if (p == NULL) return;
+  char* b = (char*)p - 1;
+  int c = (unsigned char)b[0];
+  if (c == SLAB_LARGE) {
+    free(b);
+    return;
+  }
+  memcpy(b, &E.arena.classes[c].free, sizeof(char*));
+  E.arena.classes[c].free = b;
+}
+
+// Get usable size of row buffer, or 0 if it came from malloc
+size_t rowCapacity(void* p) {
+  int c = ((unsigned char*)p)[-1];
+  return c == SLAB_LARGE ? 0 : (size_t)slabSizes[c] - 1;
+}
+
+// Resize row buffer, keeping it in place while it fits its block
+void* rowRealloc(void* p, size_t size) {
+  if (p == NULL) return rowAlloc(size);
+  char* b = (char*)p - 1;
+  int c = (unsigned char)b[0];
+  if (c == SLAB_LARGE) {
+    if (slabClass(size + 1) != SLAB_LARGE) {
+      char* q = rowAlloc(size);
+      memcpy(q, p, size);
+      free(b);
+      return q;
+    }
+    b = realloc(b, size + 1);
+    return b + 1;
+  }
+  if (size + 1 <= (size_t)slabSizes[c]) return p;
+
+  char* q = rowAlloc(size);
+  memcpy(q, p, slabSizes[c] - 1);
+  rowFree(p);
+  return q;
+}
+
+//// Storage ////
+
+// Rows are kept in a treap ordered by position, so that finding, inserting
+// or deleting a line costs O(log n) instead of shifting the whole array.
+// Rows read from a file point into the original file buffer and are only
+// copied once they are edited.
+//
+// Nodes are reference counted so that a snapshot of the tree can be taken
+// in O(1) by holding on to the root. Nodes shared with a snapshot are never
+// changed in place: splits, merges and edits copy them first, so only the
+// O(log n) nodes on the changed path are duplicated.
+
+// Count rows in tree
+int treeCount(rnode* t) {
+  return t ? t->count : 0;
+}
+
+// Update tree node
+void treeUpdate(rnode* t) {
+  t->count = 1 + treeCount(t->left) + treeCount(t->right);
+}
+
+// Check if row still points into original file buffer
+int isOriginal(erow* row) {
+  return E.original && row->chars >= E.original && row->chars < E.original + E.originalSize;
+}
+
+// Copy node if it is shared with a snapshot, so it can be changed
+rnode* unshareNode(rnode* t) {
+  if (t->refs == 1) return t;
+  rnode* c = malloc(sizeof(rnode));
+  *c = *t;
+  c->refs = 1;
+  if (c->left) c->left->refs++;
+  if (c->right) c->right->refs++;
+  t->refs--;
+
+  // Caches stay with the shared node and edited text is copied
+  if (!isOriginal(&t->row)) {
+    c->row.chars = rowAlloc(t->row.size + 1);
+    memcpy(c->row.chars, t->row.chars, t->row.size);
+    c->row.chars[t->row.size] = '\0';
+  }
+  c->row.hl = NULL;
+  c->row.hlInline = 0;
+  c->row.hlLong = 0;
+  c->row.hlEntry = -1;
+  return c;
+}
+
+// Release reference to tree, freeing nodes no longer used
+void releaseTree(rnode* t) {
+  if (t == NULL || --t->refs > 0) return;
+  releaseTree(t->left);
+  releaseTree(t->right);
+  freeRow(&t->row);
+  free(t);
+}
+
+// Split tree into the first n rows and the rest
+void treeSplit(rnode* t, int n, rnode** l, rnode** r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+
+  t = unshareNode(t);
+
+  if (treeCount(t->left) < n) {
+    treeSplit(t->right, n - treeCount(t->left) - 1, &t->right, r);
+    *l = t;
+  } else {
+    treeSplit(t->left, n, l, &t->left);
+    *r = t;
+  }
+  treeUpdate(t);
+}
+
+// Merge trees
+rnode* treeMerge(rnode* l, rnode* r) {
+  if (l == NULL) return r;
+  if (r == NULL) return l;
+
+  if (l->priority > r->priority) {
+    l = unshareNode(l);
+    l->right = treeMerge(l->right, r);
+    treeUpdate(l);
+    return l;
+  }
+  r = unshareNode(r);
+  r->left = treeMerge(l, r->left);
+  treeUpdate(r);
+  return r;
+}
+
+// Get row at index
+erow* getRow(int at) {
+  if (at < 0 || at >= E.nrows) return NULL;
+  rnode* t = E.tree;
+  while (1) {
+    int lcount = treeCount(t->left);
+    if (at < lcount) {
+      t = t->left;
+    } else if (at == lcount) {
+      return &t->row;
+    } else {
+      at -= lcount + 1;
+      t = t->right;
+    }
+  }
+}
+
+// Get row at index for editing, copying nodes shared with a snapshot
+erow* editRow(int at) {
+  if (at < 0 || at >= E.nrows) return NULL;
+  rnode** link = &E.tree;
+  while (1) {
+    rnode* t = *link = unshareNode(*link);
+    int lcount = treeCount(t->left);
+    if (at < lcount) {
+      link = &t->left;
+    } else if (at == lcount) {
+      return &t->row;
+    } else {
+      at -= lcount + 1;
+      link = &t->right;
+    }
+  }
+}
+
+// Start iterating rows of tree at index
+erow* iterTree(struct riter* it, rnode* t, int at) {
+  it->depth = 0;
+  if (at < 0 || at >= treeCount(t)) return NULL;
+  while (1) {
+    int lcount = treeCount(t->left);
+    if (at < lcount) {
+      it->stack[it->depth++] = t;
+      t = t->left;
+    } else if (at == lcount) {
+      it->stack[it->depth++] = t;
+      return &t->row;
+    } else {
+      at -= lcount + 1;
+      t = t->right;
+    }
+  }
+}
+
+// Start iterating rows at index
+erow* iterRows(struct riter* it, int at) {
+  return iterTree(it, E.tree, at);
+}
+
+// Get next row from iterator
+erow* nextRow(struct riter* it) {
+  if (it->depth == 0) return NULL;
+  rnode* t = it->stack[--it->depth]->right;
+  while (t) {
+    it->stack[it->depth++] = t;
+    t = t->left;
+  }
+  return it->depth ? &it->stack[it->depth - 1]->row : NULL;
+}
+
+// Create row node
+rnode* newRow(char* chars, size_t len) {
+  rnode* t = malloc(sizeof(rnode));
+  t->row.size = len;
+  t->row.hlEntry = -1;
+  t->row.hlOpenComment = 0;
+  t->row.hlInline = 0;
+  t->row.hlLong = 0;
+  t->row.chars = chars;
+  t->row.hl = NULL;
+  t->left = NULL;
+  t->right = NULL;
+  t->priority = rand();
+  t->count = 1;
+  t->refs = 1;
+  return t;
+}
+
+// Link tree of row nodes at index
+void linkRow(int at, rnode* t) {
+  int count = treeCount(t);
+  rnode *l, *r;
+  treeSplit(E.tree, at, &l, &r);
+  E.tree = treeMerge(treeMerge(l, t), r);
+  E.nrows = treeCount(E.tree);
+  invalidateMatches(at, count);
+}
+
+// Unlink row node at index
+rnode* unlinkRow(int at) {
+  rnode *l, *m, *r;
+  treeSplit(E.tree, at, &l, &r);
+  treeSplit(r, 1, &m, &r);
+  E.tree = treeMerge(l, r);
+  E.nrows = treeCount(E.tree);
+  invalidateMatches(at, -1);
+  return m;
+}
+
+// Check if byte continues a UTF-8 character
+int isContinuation(char c) {
+  return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+// Count UTF-8 characters in text
+size_t countCharacters(char* s, size_t len) {
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) n += !isContinuation(s[i]);
+  return n;
+}
+
+// Add or remove text from document counters
+void countText(char* s, size_t len, int sign) {
+  size_t chars = countCharacters(s, len);
+  if (sign > 0) {
+    E.nbytes += len;
+    E.nchars += chars;
+  } else {
+    E.nbytes -= len;
+    E.nchars -= chars;
+  }
+}
+
+// Copy original row characters before editing
+void ownRow(erow* row) {
+  if (!isOriginal(row)) return;
+  char* chars = rowAlloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+}
+
+// Get original file line at offset without its line ending, moving offset
+// to the next line
+char* originalLine(size_t* offset, size_t* len) {
+  char* p = E.original + *offset;
+  char* nl = memchr(p, '\n', E.originalSize - *offset);
+  *len = (nl ? nl : E.original + E.originalSize) - p;
+  *offset += *len + (nl != NULL);
+  while (*len > 0 && p[*len - 1] == '\r') (*len)--;
+  return p;
+}
+
+// Index original file rows until n rows are available
+void loadRows(int n) {
+  rnode* spine[ROW_BATCH];
+
+  while (E.nrows < n && E.indexed < E.originalSize && !E.originalLost) {
+    // Build a batch of rows in order on the right spine of a new tree
+    int depth = 0;
+    int count = 0;
+    while (count < ROW_BATCH && E.nrows + count < n && E.indexed < E.originalSize) {
+      size_t len;
+      char* p = originalLine(&E.indexed, &len);
+      if (E.originalLost) break;
+
+      rnode* t = newRow(p, len);
+      countText(p, len, 1);
+      E.nbytes++;
+      E.nchars++;
+      rnode* last = NULL;
+      while (depth > 0 && spine[depth - 1]->priority < t->priority) {
+        last = spine[--depth];
+        treeUpdate(last);
+      }
+      t->left = last;
+      if (depth > 0) spine[depth - 1]->right = t;
+      spine[depth++] = t;
+      count++;
+    }
+
+    while (depth > 0) treeUpdate(spine[--depth]);
+    if (count > 0) E.tree = treeMerge(E.tree, spine[0]);
+    E.nrows = treeCount(E.tree);
+  }
+
+  // Lines of a file truncated on disk are gone, so the rest is not indexed
+  if (E.originalLost == 1) {
+    E.originalLost = 2;
+    E.indexed = E.originalSize;
+    setStatusMessage("File truncated on disk, lines not loaded yet are lost");
+  }
 }
 
 //// Highlight ////
 
 // Check separator
 int isSeparator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  return E.lexer.charClass[(unsigned char)c] & CC_SEPARATOR;
 }
 
-// Update syntax
-void updateSyntax(erow* row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+// Hash keyword text with seed
+unsigned int hashKeyword(const char* s, int len, unsigned int seed) {
+  unsigned int h = 2166136261u ^ (seed * 16777619u) ^ len;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+// Find keyword by exact text in one probe
+struct lexeme* findKeyword(const char* s, int len) {
+  struct lexer* lx = &E.lexer;
+  if (lx->keywords == NULL || len == 0) return NULL;
+  unsigned int seed = lx->keywordSeeds[hashKeyword(s, len, 0) & lx->bucketMask];
+  struct lexeme* kw = &lx->keywords[hashKeyword(s, len, seed) & lx->keywordMask];
+  return (kw->len == len && !memcmp(kw->text, s, len)) ? kw : NULL;
+}
+
+// Build keyword table, a perfect hash where each bucket of keywords gets
+// its own seed so that no two keywords land on the same slot
+void buildKeywords(char** keywords) {
+  struct lexer* lx = &E.lexer;
+  int n = 0;
+  while (keywords[n]) n++;
+
+  // Parse keywords once, keeping the first of any duplicates
+  struct lexeme* list = malloc(sizeof(struct lexeme) * (n + 1));
+  int count = 0;
+  for (int j = 0; j < n; j++) {
+    int len = strlen(keywords[j]);
+    int common = len > 0 && keywords[j][len - 1] == '|';
+    if (common) len--;
+
+    int k;
+    for (k = 0; k < count; k++) {
+      if (list[k].len == len && !memcmp(list[k].text, keywords[j], len)) break;
+    }
+    if (k < count || len == 0) continue;
+    list[count].text = keywords[j];
+    list[count].len = len;
+    list[count].hl = common ? HL_KEYWORD_COMMON : HL_KEYWORD_ACTUAL;
+    count++;
+  }
+
+  unsigned int size = 4;
+  while (size < (unsigned int)count * 2) size *= 2;
+  unsigned int buckets = size / 4;
+
+  while (1) {
+    lx->keywordMask = size - 1;
+    lx->bucketMask = buckets - 1;
+    lx->keywords = calloc(size, sizeof(struct lexeme));
+    lx->keywordSeeds = calloc(buckets, 1);
+
+    // Place the fullest buckets first while most slots are free
+    int* bucket = malloc(sizeof(int) * (count + 1));
+    int* order = malloc(sizeof(int) * buckets);
+    int* sizes = calloc(buckets, sizeof(int));
+    for (int k = 0; k < count; k++) {
+      bucket[k] = hashKeyword(list[k].text, list[k].len, 0) & lx->bucketMask;
+      sizes[bucket[k]]++;
+    }
+    for (unsigned int b = 0; b < buckets; b++) order[b] = b;
+    for (unsigned int b = 1; b < buckets; b++) {
+      for (unsigned int c = b; c > 0 && sizes[order[c]] > sizes[order[c - 1]]; c--) {
+        int t = order[c];
+        order[c] = order[c - 1];
+        order[c - 1] = t;
+      }
+    }
+
+    int placed = 1;
+    for (unsigned int b = 0; b < buckets && placed && sizes[order[b]]; b++) {
+      placed = 0;
+      for (int seed = 1; seed < 256 && !placed; seed++) {
+        placed = 1;
+        int k;
+        for (k = 0; k < count && placed; k++) {
+          if (bucket[k] != order[b]) continue;
+          struct lexeme* slot = &lx->keywords[hashKeyword(list[k].text, list[k].len, seed) & lx->keywordMask];
+          if (slot->text) placed = 0;
+          else *slot = list[k];
+        }
+
+        // Undo a failed attempt before trying the next seed
+        if (!placed) {
+          for (int u = 0; u < k; u++) {
+            if (bucket[u] != order[b]) continue;
+            struct lexeme* slot = &lx->keywords[hashKeyword(list[u].text, list[u].len, seed) & lx->keywordMask];
+            if (slot->text == list[u].text) slot->text = NULL;
+          }
+        } else {
+          lx->keywordSeeds[order[b]] = seed;
+        }
+      }
+    }
+    free(bucket);
+    free(order);
+    free(sizes);
+    if (placed) break;
+
+    free(lx->keywords);
+    free(lx->keywordSeeds);
+    size *= 2;
+  }
+  free(list);
+}
+
+// Build operator table grouped by first character
+void buildOperators(char** operators) {
+  struct lexer* lx = &E.lexer;
+  int n = 0;
+  while (operators[n]) n++;
+  lx->operators = malloc(sizeof(struct lexeme) * (n + 1));
+
+  int count = 0;
+  for (int c = 0; c < 256; c++) {
+    lx->operatorStart[c] = count;
+    for (int j = 0; j < n; j++) {
+      if ((unsigned char)operators[j][0] != c) continue;
+      lx->operators[count].text = operators[j];
+      lx->operators[count].len = strlen(operators[j]);
+      lx->operators[count].hl = HL_OPERATOR;
+      lx->charClass[c] |= CC_OPERATOR;
+      count++;
+    }
+  }
+  lx->operatorStart[256] = count;
+}
+
+// Build lexer tables for the current syntax
+void buildLexer() {
+  struct lexer* lx = &E.lexer;
+  free(lx->keywords);
+  free(lx->keywordSeeds);
+  free(lx->operators);
+  lx->keywords = NULL;
+  lx->keywordSeeds = NULL;
+  lx->operators = NULL;
+  memset(lx->operatorStart, 0, sizeof(lx->operatorStart));
+
+  for (int c = 0; c < 256; c++) {
+    int sep = isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    lx->charClass[c] = sep ? CC_SEPARATOR : 0;
+  }
   if (E.syntax == NULL) return;
 
-  char** keywords = E.syntax->keywords;
-  char** operators = E.syntax->operators;
+  buildKeywords(E.syntax->keywords);
+  buildOperators(E.syntax->operators);
+  lx->slCommentLen = E.syntax->slCommentStart ? strlen(E.syntax->slCommentStart) : 0;
+  lx->mlStartLen = E.syntax->mlCommentStart ? strlen(E.syntax->mlCommentStart) : 0;
+  lx->mlEndLen = E.syntax->mlCommentEnd ? strlen(E.syntax->mlCommentEnd) : 0;
+}
+
+// Scan syntax state at the end of a line without highlighting it. Only
+// comments and strings change the state, and keywords, numbers and
+// operators never consume their delimiters, so they can be skipped here.
+int scanSyntax(char* s, int len, int inComment) {
   char* scs = E.syntax->slCommentStart;
   char* mcs = E.syntax->mlCommentStart;
   char* mce = E.syntax->mlCommentEnd;
-  int scslen = scs ? strlen(scs) : 0;
-  int mcslen = mcs ? strlen(mcs) : 0;
-  int mcelen = mce ? strlen(mce) : 0;
+  int scslen = E.lexer.slCommentLen;
+  int mcslen = E.lexer.mlStartLen;
+  int mcelen = E.lexer.mlEndLen;
 
-  int prevSep = 1;
   int inString = 0;
-  int inComment = (row->index > 0 && E.row[row->index - 1].hlOpenComment);
-
   int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prevHl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scslen && !inString && !inComment && !strncmp(&row->render[i], scs, scslen)) {
-      memset(&row->hl[i], HL_COMMENT_SINGLE, row->rsize - i);
-      break;
-    }
+  while (i < len) {
+    if (scslen && !inString && !inComment && len - i >= scslen && !memcmp(&s[i], scs, scslen)) break;
 
     if (mcslen && mcelen && !inString) {
       if (inComment) {
-        row->hl[i] = HL_COMMENT_MULTIPLE;
-        if (!strncmp(&row->render[i], mce, mcelen)) {
-          memset(&row->hl[i], HL_COMMENT_MULTIPLE, mcelen);
+        if (len - i >= mcelen && !memcmp(&s[i], mce, mcelen)) {
           i += mcelen;
           inComment = 0;
-          prevSep = 0;
-          continue;
         } else {
           i++;
-          continue;
         }
-      } else if (!strncmp(&row->render[i], mcs, mcslen)) {
-        memset(&row->hl[i], HL_COMMENT_MULTIPLE, mcslen);
+        continue;
+      } else if (len - i >= mcslen && !memcmp(&s[i], mcs, mcslen)) {
         i += mcslen;
         inComment = 1;
         continue;
@@ -303,9 +1351,250 @@ void updateSyntax(erow* row) {
 
     if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
       if (inString) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
+        if (s[i] == '\\' && i + 1 < len) {
+          i += 2;
+          continue;
+        }
+        if (s[i] == inString) inString = 0;
+        i++;
+        continue;
+      } else if (s[i] == '"' || s[i] == '\'') {
+        inString = s[i];
+        i++;
+        continue;
+      }
+    }
+    i++;
+  }
+  return inComment;
+}
+
+// Get syntax state leaving row entered with state
+int leaveSyntax(erow* row, int state) {
+  if (row->hlEntry == state) return row->hlOpenComment;
+  return scanSyntax(row->chars, row->size, state);
+}
+
+// Row highlights are stored as runs of one class, each a class byte and
+// its length in 7 bit groups, so that a long line of one class takes a
+// few bytes. They are built as spans of the classes other than normal.
+
+// Add span after the last one to highlight being built
+void addSpan(int start, int len, int hl) {
+  struct spanList* sl = &E.spans;
+  struct hlSpan* last = sl->count ? &sl->items[sl->count - 1] : NULL;
+  if (len <= 0 || hl == HL_NORMAL) return;
+  if (last && last->hl == hl && last->start + last->len == start) {
+    last->len += len;
+    return;
+  }
+  if (sl->count == sl->capacity) {
+    sl->capacity = sl->capacity ? sl->capacity * 2 : 64;
+    sl->items = realloc(sl->items, sl->capacity * sizeof(struct hlSpan));
+  }
+  sl->items[sl->count++] = (struct hlSpan){ start, len, hl };
+}
+
+// Mark span in lexer state, and add it to highlight being built if asked
+void markSpan(struct lexState* st, int start, int len, int hl, int spans) {
+  if (hl != HL_NORMAL) {
+    st->hlEnd = start + len;
+    st->hlLast = hl;
+  }
+  if (spans) addSpan(start, len, hl);
+}
+
+// Get encoded size of highlight run
+size_t runSize(int len) {
+  size_t n = 1;
+  do {
+    n++;
+    len >>= 7;
+  } while (len);
+  return n;
+}
+
+// Write highlight run
+unsigned char* putRun(unsigned char* p, int hl, int len) {
+  *p++ = hl;
+  while (len >= 0x80) {
+    *p++ = (len & 0x7f) | 0x80;
+    len >>= 7;
+  }
+  *p++ = len;
+  return p;
+}
+
+// Read highlight run
+unsigned char* getRun(unsigned char* p, int* hl, int* len) {
+  *hl = *p++;
+  *len = 0;
+  for (int shift = 0;; shift += 7) {
+    *len |= (*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) return p;
+  }
+}
+
+// Get encoded size of highlight runs covering characters from one index to another
+size_t highlightSize(unsigned char* runs, int from, int to) {
+  unsigned char* p = runs;
+  for (int at = from, hl, len; at < to; at += len) p = getRun(p, &hl, &len);
+  return p - runs;
+}
+
+// Load highlight runs covering characters from one index to another as spans being built
+void loadSpans(unsigned char* runs, int from, int to) {
+  E.spans.count = 0;
+  unsigned char* p = runs;
+  for (int at = from, hl, len; at < to; at += len) {
+    p = getRun(p, &hl, &len);
+    addSpan(at, len, hl);
+  }
+}
+
+// Get row highlight runs and the characters they cover, which for a long
+// row are only those around the view
+unsigned char* rowRuns(erow* row, int* from, int* to) {
+  if (row->hlLong) {
+    struct lineIndex* idx = (struct lineIndex*)row->hl;
+    *from = idx->from;
+    *to = idx->to;
+    return idx->runs;
+  }
+  *from = 0;
+  *to = row->size;
+  return row->hl;
+}
+
+// Store built spans as row highlight, after the row text if its block has
+// room. Rows are not resized for it, as they may be shared with a snapshot
+// being saved, but edited rows usually have headroom in their block.
+void storeHighlight(erow* row) {
+  struct spanList* sl = &E.spans;
+  int from, to;
+  rowRuns(row, &from, &to);
+  size_t size = 0;
+  int at = from;
+  for (int i = 0; i < sl->count; i++) {
+    if (sl->items[i].start > at) size += runSize(sl->items[i].start - at);
+    size += runSize(sl->items[i].len);
+    at = sl->items[i].start + sl->items[i].len;
+  }
+  if (at < to) size += runSize(to - at);
+
+  unsigned char* p = (unsigned char*)row->chars + row->size + 1;
+  if (row->hlLong) {
+    struct lineIndex* idx = (struct lineIndex*)row->hl;
+    p = idx->runs = realloc(idx->runs, size ? size : 1);
+  } else if (!isOriginal(row) && row->size + 1 + size <= rowCapacity(row->chars)) {
+    if (!row->hlInline) rowFree(row->hl);
+    row->hlInline = 1;
+  } else {
+    p = rowRealloc(row->hlInline ? NULL : row->hl, size);
+    row->hlInline = 0;
+  }
+  if (!row->hlLong) row->hl = p;
+
+  at = from;
+  for (int i = 0; i < sl->count; i++) {
+    if (sl->items[i].start > at) p = putRun(p, HL_NORMAL, sl->items[i].start - at);
+    p = putRun(p, sl->items[i].hl, sl->items[i].len);
+    at = sl->items[i].start + sl->items[i].len;
+  }
+  if (at < to) putRun(p, HL_NORMAL, to - at);
+}
+
+// Drop row highlight stored after the text, which an edit may have overwritten
+void dropHighlight(erow* row) {
+  if (!row->hlInline) return;
+  row->hl = NULL;
+  row->hlInline = 0;
+}
+
+// Overlay span on row highlight
+void overlayHighlight(erow* row, int start, int len, int hl) {
+  int from, to;
+  unsigned char* runs = rowRuns(row, &from, &to);
+  if (start < from || start >= to) return;
+  if (len > to - start) len = to - start;
+  loadSpans(runs, from, to);
+  int n = E.spans.count;
+  struct hlSpan* spans = malloc(n * sizeof(struct hlSpan));
+  memcpy(spans, E.spans.items, n * sizeof(struct hlSpan));
+
+  E.spans.count = 0;
+  for (int i = 0; i < n && spans[i].start < start; i++) {
+    int end = spans[i].start + spans[i].len;
+    addSpan(spans[i].start, (end < start ? end : start) - spans[i].start, spans[i].hl);
+  }
+  addSpan(start, len, hl);
+  for (int i = 0; i < n; i++) {
+    int from = spans[i].start > start + len ? spans[i].start : start + len;
+    addSpan(from, spans[i].start + spans[i].len - from, spans[i].hl);
+  }
+  storeHighlight(row);
+  free(spans);
+}
+
+// Lex row from lexer state up to the first token at or after limit, adding
+// spans to the highlight being built if asked, and return whether the rest
+// of the row was lexed
+int lexRow(erow* row, struct lexState* st, int limit, int spans) {
+  if (E.syntax == NULL) {
+    st->i = (limit < row->size) ? limit : row->size;
+    return st->i == row->size;
+  }
+
+  struct lexer* lx = &E.lexer;
+  char* scs = E.syntax->slCommentStart;
+  char* mcs = E.syntax->mlCommentStart;
+  char* mce = E.syntax->mlCommentEnd;
+  int scslen = lx->slCommentLen;
+  int mcslen = lx->mlStartLen;
+  int mcelen = lx->mlEndLen;
+
+  int prevSep = st->prevSep;
+  int inString = st->inString;
+  int inComment = st->inComment;
+
+  int i = st->i;
+  while (i < row->size) {
+    if (i >= limit) break;
+    char c = row->chars[i];
+    unsigned char prevHl = (st->hlEnd == i) ? st->hlLast : HL_NORMAL;
+
+    if (scslen && !inString && !inComment && row->size - i >= scslen && !memcmp(&row->chars[i], scs, scslen)) {
+      markSpan(st, i, row->size - i, HL_COMMENT_SINGLE, spans);
+      i = row->size;
+      break;
+    }
+
+    if (mcslen && mcelen && !inString) {
+      if (inComment) {
+        if (row->size - i >= mcelen && !memcmp(&row->chars[i], mce, mcelen)) {
+          markSpan(st, i, mcelen, HL_COMMENT_MULTIPLE, spans);
+          i += mcelen;
+          inComment = 0;
+          prevSep = 0;
+          continue;
+        } else {
+          markSpan(st, i, 1, HL_COMMENT_MULTIPLE, spans);
+          i++;
+          continue;
+        }
+      } else if (row->size - i >= mcslen && !memcmp(&row->chars[i], mcs, mcslen)) {
+        markSpan(st, i, mcslen, HL_COMMENT_MULTIPLE, spans);
+        i += mcslen;
+        inComment = 1;
+        continue;
+      }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (inString) {
+        markSpan(st, i, 1, HL_STRING, spans);
+        if (c == '\\' && i + 1 < row->size) {
+          markSpan(st, i + 1, 1, HL_STRING, spans);
           i += 2;
           continue;
         }
@@ -315,7 +1604,7 @@ void updateSyntax(erow* row) {
         continue;
       } else if (c == '"' || c == '\'') {
         inString = c;
-        row->hl[i] = HL_STRING;
+        markSpan(st, i, 1, HL_STRING, spans);
         i++;
         continue;
       }
@@ -323,7 +1612,7 @@ void updateSyntax(erow* row) {
 
     if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
       if ((isdigit(c) && (prevSep || prevHl == HL_NUMBER)) || (c == '.' && prevHl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
+        markSpan(st, i, 1, HL_NUMBER, spans);
         i++;
         prevSep = 0;
         continue;
@@ -331,32 +1620,26 @@ void updateSyntax(erow* row) {
     }
 
     if (prevSep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kwc = keywords[j][klen - 1] == '|';
-        if (kwc) klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) && isSeparator(row->render[i + klen])) {
-          memset(&row->hl[i], kwc ? HL_KEYWORD_COMMON : HL_KEYWORD_ACTUAL, klen);
-          i += klen;
-          break;
-        }
-      }
+      int klen = 0;
+      while (i + klen < row->size && !isSeparator(row->chars[i + klen])) klen++;
 
-      if (keywords[j] != NULL) {
+      struct lexeme* kw = findKeyword(&row->chars[i], klen);
+      if (kw) {
+        markSpan(st, i, klen, kw->hl, spans);
+        i += klen;
         prevSep = 0;
         continue;
       }
     }
 
-    {
-      int j;
-      for (j = 0; operators[j]; j++) {
-        int olen = strlen(operators[j]);
-        if (!strncmp(&row->render[i], operators[j], olen)) {
-          memset(&row->hl[i], HL_OPERATOR, olen);
-          i += olen - 1;
+    if (lx->charClass[(unsigned char)c] & CC_OPERATOR) {
+      int first = lx->operatorStart[(unsigned char)c];
+      int last = lx->operatorStart[(unsigned char)c + 1];
+      for (int j = first; j < last; j++) {
+        struct lexeme* op = &lx->operators[j];
+        if (row->size - i >= op->len && !memcmp(&row->chars[i], op->text, op->len)) {
+          markSpan(st, i, op->len, HL_OPERATOR, spans);
+          i += op->len - 1;
           break;
         }
       }
@@ -366,9 +1649,312 @@ void updateSyntax(erow* row) {
     i++;
   }
 
-  int changed = (row->hlOpenComment != inComment);
-  row->hlOpenComment = inComment;
-  if (changed && row->index + 1 < E.nrows) updateSyntax(&E.row[row->index + 1]);
+  st->i = i;
+  st->prevSep = prevSep;
+  st->inString = inString;
+  st->inComment = inComment;
+  return i >= row->size;
+}
+
+// Update syntax
+void updateSyntax(erow* row, int state) {
+  struct lexState st = { 0, state, 0, 1, -1, HL_NORMAL };
+  E.spans.count = 0;
+  row->hlEntry = state;
+  lexRow(row, &st, INT_MAX, 1);
+  row->hlOpenComment = E.syntax ? st.inComment : 0;
+  storeHighlight(row);
+}
+
+// Rows of LINE_LONG characters or more keep an index of chunks of about
+// LINE_CHUNK characters instead of a highlight, each starting at a token
+// with the lexer state and render column there. An edit is lexed again
+// from the chunk it is in until the state meets a chunk it did not reach,
+// and only the characters in view are highlighted, from the chunk the view
+// starts in.
+
+// Measure long row chunk ending at index, as the characters before its
+// first tab and the render width after that tab, which do not depend on
+// the render index the chunk starts at
+void measureChunk(erow* row, struct lineChunk* ch, int end) {
+  char* tab = memchr(&row->chars[ch->start], '\t', end - ch->start);
+  ch->lead = countCharacters(&row->chars[ch->start], (tab ? tab - row->chars : end) - ch->start);
+  ch->tail = tab ? renderWidth(row, tab - row->chars + 1, end, 0) : -1;
+}
+
+// Add chunk at lexer state to line index of row, ending the last one there
+void addChunk(erow* row, struct lineIndex* idx, struct lexState* st) {
+  if (idx->count) measureChunk(row, &idx->chunks[idx->count - 1], st->i);
+  if (idx->count == idx->capacity) {
+    idx->capacity = idx->capacity ? idx->capacity * 2 : 16;
+    idx->chunks = realloc(idx->chunks, idx->capacity * sizeof(struct lineChunk));
+  }
+  struct lineChunk* ch = &idx->chunks[idx->count++];
+  ch->start = st->i;
+  ch->rx = 0;
+  ch->lead = 0;
+  ch->tail = -1;
+  ch->inString = st->inString;
+  ch->inComment = st->inComment;
+  ch->prevSep = st->prevSep;
+  ch->prevHl = (st->hlEnd == st->i) ? st->hlLast : HL_NORMAL;
+}
+
+// Load lexer state at start of chunk
+void loadChunk(struct lineChunk* ch, struct lexState* st) {
+  st->i = ch->start;
+  st->inComment = ch->inComment;
+  st->inString = ch->inString;
+  st->prevSep = ch->prevSep;
+  st->hlEnd = (ch->prevHl != HL_NORMAL) ? ch->start : -1;
+  st->hlLast = ch->prevHl;
+}
+
+// Check if lexer state is the one at start of chunk
+int sameChunk(struct lineChunk* ch, struct lexState* st) {
+  int prevHl = (st->hlEnd == st->i) ? st->hlLast : HL_NORMAL;
+  return ch->start == st->i && ch->inComment == st->inComment && ch->inString == st->inString && ch->prevSep == st->prevSep && ch->prevHl == prevHl;
+}
+
+// Lex long row from its last chunk, adding chunks until the state is the
+// same as at one of the old chunks after it, which are kept from there
+void scanIndex(erow* row, struct lineIndex* idx, struct lineChunk* old, int nold) {
+  struct lexState st;
+  loadChunk(&idx->chunks[idx->count - 1], &st);
+  int last = st.i;
+  int o = 0;
+  while (1) {
+    // Old chunks a little over the chunk size away are not split
+    int limit = last + LINE_CHUNK;
+    if (o < nold && old[o].start < limit + LINE_CHUNK / 2) limit = old[o].start;
+    if (lexRow(row, &st, limit, 0)) break;
+
+    for (; o < nold && old[o].start <= st.i; o++) {
+      if (!sameChunk(&old[o], &st)) continue;
+
+      // The rest of the row lexes as before
+      measureChunk(row, &idx->chunks[idx->count - 1], st.i);
+      if (idx->count + nold - o > idx->capacity) {
+        idx->capacity = idx->count + nold - o;
+        idx->chunks = realloc(idx->chunks, idx->capacity * sizeof(struct lineChunk));
+      }
+      memcpy(&idx->chunks[idx->count], &old[o], (nold - o) * sizeof(struct lineChunk));
+      idx->count += nold - o;
+      return;
+    }
+    if (st.i >= last + LINE_CHUNK) {
+      addChunk(row, idx, &st);
+      last = st.i;
+    }
+  }
+  measureChunk(row, &idx->chunks[idx->count - 1], row->size);
+  row->hlOpenComment = st.inComment;
+}
+
+// Build index of long row entered with state
+void indexLine(erow* row, int state) {
+  struct lineIndex* idx = (struct lineIndex*)row->hl;
+  struct lexState st = { 0, state, 0, 1, -1, HL_NORMAL };
+  idx->count = 0;
+  addChunk(row, idx, &st);
+  idx->rxValid = 1;
+  idx->to = -1;
+  row->hlEntry = state;
+  scanIndex(row, idx, NULL, 0);
+  if (E.syntax == NULL) row->hlOpenComment = 0;
+}
+
+// Update index of long row after count characters at index were replaced
+// by added ones, lexing again from the chunk before them. Tokens are read
+// ahead less than LINE_SLACK characters, so chunks that far before are kept,
+// and chunks after keep their widths.
+void editIndex(erow* row, int at, int count, int added) {
+  struct lineIndex* idx = (struct lineIndex*)row->hl;
+  int k = idx->count - 1;
+  while (k > 0 && idx->chunks[k].start + LINE_SLACK > at) k--;
+
+  // Chunks past the edited characters move with the text after them
+  int nold = 0;
+  struct lineChunk* old = malloc((idx->count - k) * sizeof(struct lineChunk));
+  for (int j = k + 1; j < idx->count; j++) {
+    if (idx->chunks[j].start < at + count) continue;
+    old[nold] = idx->chunks[j];
+    old[nold++].start += added - count;
+  }
+  idx->count = k + 1;
+  if (idx->rxValid > k + 1) idx->rxValid = k + 1;
+  idx->to = -1;
+  scanIndex(row, idx, old, nold);
+  free(old);
+}
+
+// Free index of long row
+void freeIndex(erow* row) {
+  struct lineIndex* idx = (struct lineIndex*)row->hl;
+  free(idx->chunks);
+  free(idx->runs);
+  free(idx);
+  row->hl = NULL;
+  row->hlLong = 0;
+}
+
+// Propagate a pending syntax state change up to row, or for at most
+// budget rows. Rows past the pending row still carry the states from
+// before the change, so propagation stops at the first checkpoint or
+// highlighted row that already expects the new state.
+void propagateSyntax(int until, int budget) {
+  int j = E.syntaxFrom;
+  int state = E.syntaxPending;
+  if (j < 0) return;
+
+  struct riter it;
+  erow* row = iterRows(&it, j);
+  for (; j < until && budget > 0; j++, budget--, row = nextRow(&it)) {
+    if (j % HL_CHECKPOINT == 0) {
+      int k = j / HL_CHECKPOINT;
+      if (k >= E.ncheckpoints || (j >= E.syntaxBarrier && E.checkpoints[k] == state)) break;
+      E.checkpoints[k] = state;
+    }
+    if (row == NULL || (j >= E.syntaxBarrier && row->hlEntry == state)) break;
+
+    state = leaveSyntax(row, state);
+  }
+
+  if (j < until && budget > 0) {
+    E.syntaxFrom = -1;
+  } else {
+    E.syntaxFrom = j;
+    E.syntaxPending = state;
+  }
+}
+
+// Start propagating a syntax state change from row
+void startSyntax(int at, int state) {
+  if (E.syntaxFrom >= 0 && E.syntaxFrom < at) {
+    if (E.syntaxBarrier < at) E.syntaxBarrier = at;
+    return;
+  }
+
+  // Rows up to a pending row may already hold states of an earlier change
+  if (E.syntaxFrom < 0 || E.syntaxBarrier < E.syntaxFrom) E.syntaxBarrier = E.syntaxFrom;
+  if (E.syntaxBarrier < at) E.syntaxBarrier = at;
+  E.syntaxFrom = at;
+  E.syntaxPending = state;
+}
+
+// Add syntax checkpoint for the next multiple of HL_CHECKPOINT rows
+void addCheckpoint(int state) {
+  if (E.ncheckpoints == E.checkpointCapacity) {
+    E.checkpointCapacity *= 2;
+    E.checkpoints = realloc(E.checkpoints, E.checkpointCapacity);
+  }
+  E.checkpoints[E.ncheckpoints++] = state;
+}
+
+// Scan slice of rows on worker thread under both entry states, recording
+// the states at each checkpoint. Both runs share the scan once their
+// states meet, since the rows after that see the same state.
+void* syntaxThread(void* arg) {
+  struct syntaxSlice* slice = arg;
+  int state[2] = { 0, 1 };
+  int n = 0;
+  struct riter it;
+  erow* row = iterRows(&it, slice->first);
+  for (int j = 0; j < slice->nrows; j++, row = nextRow(&it)) {
+    if (state[0] == state[1]) {
+      state[0] = state[1] = leaveSyntax(row, state[0]);
+    } else {
+      state[0] = leaveSyntax(row, state[0]);
+      state[1] = leaveSyntax(row, state[1]);
+    }
+    if ((j + 1) % HL_CHECKPOINT == 0) {
+      slice->states[0][n] = state[0];
+      slice->states[1][n] = state[1];
+      n++;
+    }
+  }
+  slice->exit[0] = state[0];
+  slice->exit[1] = state[1];
+  return NULL;
+}
+
+// Extend checkpoints up to row in parallel when many rows are missing.
+// Slices are scanned speculatively and then chained in order, each taking
+// the states of the run that matches the state the slice before left.
+void extendCheckpoints(int at) {
+  int from = (E.ncheckpoints - 1) * HL_CHECKPOINT;
+  int to = at / HL_CHECKPOINT * HL_CHECKPOINT;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = (to - from) / HL_SLICE;
+  if (nthreads > cpus) nthreads = cpus;
+  if (nthreads > HL_THREADS) nthreads = HL_THREADS;
+  if (nthreads <= 1) return;
+
+  struct syntaxSlice slices[HL_THREADS];
+  int blocks = (to - from) / HL_CHECKPOINT;
+  for (int i = 0; i < nthreads; i++) {
+    struct syntaxSlice* slice = &slices[i];
+    slice->first = from + (long)blocks * i / nthreads * HL_CHECKPOINT;
+    slice->nrows = from + (long)blocks * (i + 1) / nthreads * HL_CHECKPOINT - slice->first;
+    slice->states[0] = malloc(slice->nrows / HL_CHECKPOINT);
+    slice->states[1] = malloc(slice->nrows / HL_CHECKPOINT);
+    if (pthread_create(&slice->thread, NULL, syntaxThread, slice) != 0) throw("pthread_create");
+  }
+
+  int state = E.checkpoints[E.ncheckpoints - 1];
+  for (int i = 0; i < nthreads; i++) {
+    struct syntaxSlice* slice = &slices[i];
+    pthread_join(slice->thread, NULL);
+    for (int k = 0; k < slice->nrows / HL_CHECKPOINT; k++) addCheckpoint(slice->states[state][k]);
+    state = slice->exit[state];
+    free(slice->states[0]);
+    free(slice->states[1]);
+  }
+}
+
+// Get syntax state entering row, scanning from the nearest checkpoint
+int syntaxState(int at) {
+  if (E.syntax == NULL || at <= 0) return 0;
+  propagateSyntax(at + 1, INT_MAX);
+  if (E.ncheckpoints == 0) {
+    if (E.checkpointCapacity == 0) {
+      E.checkpointCapacity = 64;
+      E.checkpoints = malloc(E.checkpointCapacity);
+    }
+    E.checkpoints[E.ncheckpoints++] = 0;
+  }
+
+  int k = at / HL_CHECKPOINT;
+  if (k >= E.ncheckpoints) {
+    extendCheckpoints(at);
+    if (k >= E.ncheckpoints) k = E.ncheckpoints - 1;
+  }
+  int state = E.checkpoints[k];
+
+  struct riter it;
+  erow* row = iterRows(&it, k * HL_CHECKPOINT);
+  for (int j = k * HL_CHECKPOINT; j < at; j++, row = nextRow(&it)) {
+    state = leaveSyntax(row, state);
+
+    // Record checkpoints passed beyond the last known one
+    if ((j + 1) % HL_CHECKPOINT == 0 && (j + 1) / HL_CHECKPOINT == E.ncheckpoints) addCheckpoint(state);
+  }
+  return state;
+}
+
+// Invalidate syntax checkpoints after rows were inserted or deleted at row
+void invalidateSyntax(int at) {
+  if (E.ncheckpoints > at / HL_CHECKPOINT + 1) E.ncheckpoints = at / HL_CHECKPOINT + 1;
+  if (E.syntaxFrom > at) E.syntaxFrom = -1;
+}
+
+// Reset syntax after the filetype changed, rows are highlighted again when drawn
+void resetSyntax() {
+  buildLexer();
+  E.ncheckpoints = 0;
+  E.syntaxFrom = -1;
+  struct riter it;
+  for (erow* row = iterRows(&it, 0); row; row = nextRow(&it)) row->hlEntry = -1;
 }
 
 // Convert syntax to color
@@ -399,326 +1985,1746 @@ void selectSyntaxHighlight() {
       int isExt = s->match[i][0] == '.';
       if ((isExt && ext && !strcmp(ext, s->match[i])) || (!isExt && strstr(E.filename, s->match[i]))) {
         E.syntax = s;
-
-        for (int fr = 0; fr < E.nrows; fr++) {
-          updateSyntax(&E.row[fr]);
-        }
+        resetSyntax();
         return;
       }
       i++;
     }
   }
+  resetSyntax();
 }
 
 //// Row ////
 
+// Get render index after characters from one index to another, starting
+// from render index. Characters between tabs take a column each.
+int renderWidth(erow* row, int from, int to, int rx) {
+  char* p = &row->chars[from];
+  char* end = &row->chars[to];
+  while (p < end) {
+    char* tab = memchr(p, '\t', end - p);
+    if (tab == NULL) return rx + countCharacters(p, end - p);
+    rx += countCharacters(p, tab - p);
+    rx += TAB_STOP - rx % TAB_STOP;
+    p = tab + 1;
+  }
+  return rx;
+}
+
+// Find render indices of long row chunks up to chunk from their widths,
+// which edits leave to be found again from the chunk they were in
+void renderChunks(struct lineIndex* idx, int k) {
+  for (; idx->rxValid <= k; idx->rxValid++) {
+    struct lineChunk* prev = &idx->chunks[idx->rxValid - 1];
+    int rx = prev->rx + prev->lead;
+    if (prev->tail >= 0) rx += TAB_STOP - rx % TAB_STOP + prev->tail;
+    idx->chunks[idx->rxValid].rx = rx;
+  }
+}
+
+// Find long row chunk with character index
+int characterChunk(struct lineIndex* idx, int cx) {
+  int lo = 0, hi = idx->count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (idx->chunks[mid].start <= cx) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+// Find long row chunk with render index
+int renderChunk(struct lineIndex* idx, int rx) {
+  while (idx->rxValid < idx->count && idx->chunks[idx->rxValid - 1].rx <= rx) renderChunks(idx, idx->rxValid);
+  int lo = 0, hi = idx->rxValid - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (idx->chunks[mid].rx <= rx) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
 // Convert character index to render index
 int characterToRender(erow* row, int cx) {
-  int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-    rx++;
+  if (!row->hlLong) return renderWidth(row, 0, cx, 0);
+  struct lineIndex* idx = (struct lineIndex*)row->hl;
+  int k = characterChunk(idx, cx);
+  renderChunks(idx, k);
+  return renderWidth(row, idx->chunks[k].start, cx, idx->chunks[k].rx);
+}
+
+// Convert render index to character index
+int renderToCharacter(erow* row, int rx) {
+  int cur = 0;
+  int cx = 0;
+  if (row->hlLong) {
+    struct lineIndex* idx = (struct lineIndex*)row->hl;
+    int k = renderChunk(idx, rx);
+    cx = idx->chunks[k].start;
+    cur = idx->chunks[k].rx;
   }
-  return rx;
+
+  // Characters between tabs take a column each
+  while (cx < row->size) {
+    char* tab = memchr(&row->chars[cx], '\t', row->size - cx);
+    int n = tab ? tab - row->chars : row->size;
+    for (; cx < n; cx++) {
+      if (isContinuation(row->chars[cx])) continue;
+      if (cur == rx) return cx;
+      cur++;
+    }
+    if (tab == NULL) break;
+    cur += TAB_STOP - cur % TAB_STOP;
+    if (cur > rx) return cx;
+    cx++;
+  }
+  return cx;
+}
+
+// Update row after count characters at index were replaced by added ones,
+// or after any change if the index is negative
+void updateRowRange(int at, int cx, int count, int added) {
+  erow* row = getRow(at);
+  dropHighlight(row);
+  invalidateMatches(at, 0);
+  int entry = row->hlEntry;
+  int prev = row->hlOpenComment;
+  row->hlEntry = -1;
+  int state = syntaxState(at);
+
+  // Long rows keep their index, lexed again around the edit
+  if (row->hlLong && cx >= 0 && entry == state && row->size >= LINE_LONG / 2) {
+    editIndex(row, cx, count, added);
+    row->hlEntry = state;
+  } else if (row->hlLong) {
+    freeIndex(row);
+  }
+  if (E.syntax == NULL) return;
+
+  // Rows below only change if the state leaving this row changed
+  if (entry != state) prev = -1;
+  int next = (row->hlEntry == state) ? row->hlOpenComment : scanSyntax(row->chars, row->size, state);
+  if (next != prev) startSyntax(at + 1, next);
+}
+
+// Update row after its characters changed
+void updateRow(int at) {
+  updateRowRange(at, -1, 0, 0);
+}
+
+// Highlight characters of long row in view, from the chunk the view starts in
+void highlightLine(erow* row, int state) {
+  if (!row->hlLong) {
+    if (!row->hlInline) rowFree(row->hl);
+    row->hl = calloc(1, sizeof(struct lineIndex));
+    row->hlInline = 0;
+    row->hlLong = 1;
+    row->hlEntry = -1;
+  }
+  struct lineIndex* idx = (struct lineIndex*)row->hl;
+  if (row->hlEntry != state) indexLine(row, state);
+
+  int k = renderChunk(idx, E.dx);
+  int to = renderToCharacter(row, E.dx + E.cols) + 1;
+  if (to > row->size) to = row->size;
+  if (idx->to >= 0 && idx->from == idx->chunks[k].start && idx->to >= to) return;
+
+  struct lexState st;
+  loadChunk(&idx->chunks[k], &st);
+  E.spans.count = 0;
+  lexRow(row, &st, to, 1);
+  idx->from = idx->chunks[k].start;
+  idx->to = st.i;
+  storeHighlight(row);
+}
+
+// Get row with its highlight up to date
+erow* highlightRow(int at, int state) {
+  erow* row = getRow(at);
+  if (row->hlLong || row->size >= LINE_LONG) highlightLine(row, state);
+  else if (row->hlEntry != state) updateSyntax(row, state);
+  return row;
+}
+
+// Insert row
+void insertRow(int at, char* s, size_t len) {
+  if (at < 0 || at > E.nrows) return;
+  char* chars = rowAlloc(len + 1);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+
+  linkRow(at, newRow(chars, len));
+  countText(chars, len, 1);
+  E.nbytes++;
+  E.nchars++;
+  invalidateSyntax(at);
+  updateRow(at);
+  E.dirty++;
+}
+
+// Free row
+void freeRow(erow *row) {
+  if (row->hlLong) freeIndex(row);
+  else if (!row->hlInline) rowFree(row->hl);
+  if (!isOriginal(row)) rowFree(row->chars);
+}
+
+// Delete row
+void deleteRow(int at) {
+  if (at < 0 || at >= E.nrows) return;
+  rnode* t = unlinkRow(at);
+  countText(t->row.chars, t->row.size, -1);
+  E.nbytes--;
+  E.nchars--;
+  releaseTree(t);
+  invalidateSyntax(at);
+  E.dirty++;
+}
+
+// Insert character to row
+void rowInsertCharacter(int at, int cx, int c) {
+  erow* row = editRow(at);
+  ownRow(row);
+  if (cx < 0 || cx > row->size) cx = row->size;
+  int count = 0;
+  if (E.insert == 0 || cx == row->size) {
+    row->chars = rowRealloc(row->chars, row->size + 2);
+    memmove(&row->chars[cx + 1], &row->chars[cx], ++row->size - cx);
+  } else {
+    countText(&row->chars[cx], 1, -1);
+    count = 1;
+  }
+  row->chars[cx] = c;
+  countText(&row->chars[cx], 1, 1);
+  updateRowRange(at, cx, count, 1);
+  E.dirty++;
+}
+
+// Insert string to row
+void rowInsertString(int at, int cx, char* s, size_t len) {
+  erow* row = editRow(at);
+  ownRow(row);
+  if (cx < 0 || cx > row->size) cx = row->size;
+  row->chars = rowRealloc(row->chars, row->size + len + 1);
+  memmove(&row->chars[cx + len], &row->chars[cx], row->size - cx + 1);
+  memcpy(&row->chars[cx], s, len);
+  countText(s, len, 1);
+  row->size += len;
+  updateRowRange(at, cx, 0, len);
+  E.dirty++;
+}
+
+// Append string
+void appendString(int at, char* s, size_t len) {
+  erow* row = editRow(at);
+  ownRow(row);
+  row->chars = rowRealloc(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  countText(s, len, 1);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  updateRowRange(at, row->size - len, 0, len);
+  E.dirty++;
+}
+
+// Delete character from row
+void rowDeleteCharacter(int at, int cx) {
+  erow* row = getRow(at);
+  if (cx < 0 || cx >= row->size) return;
+  row = editRow(at);
+  ownRow(row);
+  countText(&row->chars[cx], 1, -1);
+  memmove(&row->chars[cx], &row->chars[cx + 1], row->size-- - cx);
+  updateRowRange(at, cx, 1, 0);
+  E.dirty++;
+}
+
+//// Editor ////
+
+// Insert character
+void insertCharacter(int c) {
+  if (c == CTRL_KEY(c)) return;
+  if (E.cy == E.nrows) insertRow(E.nrows, "", 0);
+  rowInsertCharacter(E.cy, E.cx++, c);
+  resetCursor();
+}
+
+// Insert text at cursor as a single edit
+void insertText(char* s, size_t len) {
+  // Line breaks become newlines and other control characters are dropped
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') continue;
+    if (s[i] == '\r' || s[i] == '\n') s[n++] = '\n';
+    else if (s[i] == '\t' || !iscntrl((unsigned char)s[i])) s[n++] = s[i];
+  }
+  len = n;
+  if (len == 0) return;
+  if (E.cy == E.nrows) insertRow(E.nrows, "", 0);
+
+  char* first = memchr(s, '\n', len);
+  if (first == NULL) {
+    rowInsertString(E.cy, E.cx, s, len);
+    E.cx += len;
+    resetCursor();
+    return;
+  }
+
+  // Text after the cursor moves to the end of the last line
+  char* last = (char*)memrchr(s, '\n', len) + 1;
+  size_t lastLen = s + len - last;
+  erow* row = editRow(E.cy);
+  ownRow(row);
+  size_t tailLen = row->size - E.cx;
+  char* tail = rowAlloc(lastLen + tailLen + 1);
+  memcpy(tail, last, lastLen);
+  memcpy(&tail[lastLen], &row->chars[E.cx], tailLen);
+  tail[lastLen + tailLen] = '\0';
+  countText(&row->chars[E.cx], tailLen, -1);
+
+  row->size = E.cx;
+  row->chars = rowRealloc(row->chars, row->size + (first - s) + 1);
+  memcpy(&row->chars[row->size], s, first - s);
+  countText(s, first - s, 1);
+  row->size += first - s;
+  row->chars[row->size] = '\0';
+
+  // Rows are built into a tree and linked at once, without rehighlighting,
+  // which happens once below
+  rnode* added = NULL;
+  int at = E.cy + 1;
+  for (char* p = first + 1; p < last; at++) {
+    char* nl = memchr(p, '\n', last - p);
+    char* chars = rowAlloc(nl - p + 1);
+    memcpy(chars, p, nl - p);
+    chars[nl - p] = '\0';
+    added = treeMerge(added, newRow(chars, nl - p));
+    countText(chars, nl - p, 1);
+    E.nbytes++;
+    E.nchars++;
+    p = nl + 1;
+  }
+  added = treeMerge(added, newRow(tail, lastLen + tailLen));
+  linkRow(E.cy + 1, added);
+  countText(tail, lastLen + tailLen, 1);
+  E.nbytes++;
+  E.nchars++;
+
+  invalidateSyntax(E.cy + 1);
+  updateRowRange(E.cy, E.cx, tailLen, first - s);
+  E.dirty++;
+  E.cy = at;
+  E.cx = lastLen;
+  resetCursor();
+}
+
+// Insert line
+void insertLine() {
+  if (E.cx == 0) {
+    insertRow(E.cy, "", 0);
+  } else {
+    erow* row = getRow(E.cy);
+    insertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    row = editRow(E.cy);
+    int count = row->size - E.cx;
+    countText(&row->chars[E.cx], count, -1);
+    row->size = E.cx;
+    if (!isOriginal(row)) row->chars[row->size] = '\0';
+    updateRowRange(E.cy, E.cx, count, 0);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+// Delete character
+void deleteCharacter() {
+  if (E.cy == E.nrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow* row = getRow(E.cy);
+  if (E.cx > 0) {
+    rowDeleteCharacter(E.cy, --E.cx);
+  } else {
+    E.cx = getRow(E.cy - 1)->size;
+    appendString(E.cy - 1, row->chars, row->size);
+    deleteRow(E.cy--);
+  }
+  resetCursor();
+}
+
+//// File ////
+
+// Write all buffers, continuing after short writes
+int writeAll(int fd, struct iovec* iov, int n) {
+  while (n > 0) {
+    ssize_t written = writev(fd, iov, n);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+// Publish save progress to the input thread
+void reportSave(struct saveJob* job, size_t done, int finished) {
+  pthread_mutex_lock(&job->lock);
+  job->done = done;
+  job->finished = finished;
+  pthread_mutex_unlock(&job->lock);
+  uint64_t one = 1;
+  write(E.savefd, &one, sizeof(one));
+}
+
+// Stream snapshot rows to file in batches, followed by the lines that were
+// not indexed when the snapshot was taken
+int writeRows(struct saveJob* job) {
+  struct iovec iov[SAVE_IOV];
+  int n = 0;
+  size_t done = 0, shown = 0;
+
+  struct riter it;
+  erow* row = iterTree(&it, job->tree, 0);
+  size_t offset = job->indexed;
+  while (row || offset < E.originalSize) {
+    size_t len;
+    char* chars;
+    if (row) {
+      chars = row->chars;
+      len = row->size;
+      row = nextRow(&it);
+    } else {
+      chars = originalLine(&offset, &len);
+      if (E.originalLost != job->lost) break;
+    }
+    iov[n++] = (struct iovec){chars, len};
+    iov[n++] = (struct iovec){"\n", 1};
+    done += len + 1;
+
+    if (n == SAVE_IOV) {
+      if (writeAll(job->fd, iov, n) == -1) return -1;
+      n = 0;
+    }
+    if (job->total >= SAVE_PROGRESS && done - shown >= SAVE_PROGRESS) {
+      shown = done;
+      reportSave(job, done, 0);
+    }
+  }
+  return writeAll(job->fd, iov, n);
+}
+
+// Write snapshot to the temp file, flush it to disk and rename it into
+// place, or to the file itself if there is no temp file
+void* saveThread(void* arg) {
+  struct saveJob* job = arg;
+  if (writeRows(job) == -1) job->error = errno;
+
+  // Pages of a file truncated during the save read as zeros
+  struct stat st;
+  if (job->needed && (E.originalLost != job->lost || fstat(E.originalFd, &st) == -1 || (size_t)st.st_size < job->needed)) {
+    job->truncated = 1;
+    if (job->error == 0) job->error = EIO;
+  }
+  if (job->error == 0 && fsync(job->fd) == -1) job->error = errno;
+  if (close(job->fd) == -1 && job->error == 0) job->error = errno;
+  if (job->tmp[0] && job->error == 0 && rename(job->tmp, job->filename) == -1) job->error = errno;
+  if (job->tmp[0] && job->error) unlink(job->tmp);
+  reportSave(job, job->total, 1);
+  return NULL;
+}
+
+// Wait for the save thread and report the result of the save
+void finishSave() {
+  struct saveJob* job = E.save;
+  if (job == NULL) return;
+  pthread_join(E.saveThread, NULL);
+  E.save = NULL;
+
+  // Edits made after the snapshot keep the buffer modified
+  if (job->truncated) {
+    setStatusMessage("Cannot save! File truncated on disk while saving");
+  } else if (job->error) {
+    setStatusMessage("Cannot save! I/O error: %s", strerror(job->error));
+  } else {
+    if (E.dirty == job->dirty) E.dirty = 0;
+    setStatusMessage("File saved successfully");
+  }
+  releaseTree(job->tree);
+  pthread_mutex_destroy(&job->lock);
+  free(job->filename);
+  free(job);
+}
+
+// Show save progress, finishing the save once the thread is done
+void updateSave() {
+  struct saveJob* job = E.save;
+  if (job == NULL) return;
+  pthread_mutex_lock(&job->lock);
+  size_t done = job->done;
+  int finished = job->finished;
+  pthread_mutex_unlock(&job->lock);
+
+  if (finished) {
+    finishSave();
+  } else if (job->total > 0) {
+    setStatusMessage("Saving... %d%%", (int)(done * 100 / job->total));
+  }
+}
+
+// Display file size
+char* displayFileSize() {
+  // Rows not indexed yet still have their bytes in the original file
+  size_t len = E.nbytes + E.originalSize - E.indexed;
+
+  double size = len;
+  char* unit = "B";
+  if (size >= 1000) { size /= 1024; unit = "KB"; }
+  if (size >= 1000) { size /= 1024; unit = "MB"; }
+  if (size >= 1000) { size /= 1024; unit = "GB"; }
+  static char str[80];
+  snprintf(str, sizeof(str), len < 1000 ? "%.0f %s" : "%.02f %s", size, unit);
+  return str;
+}
+
+// Replace pages of the mapped file that were truncated on disk with zeros,
+// so that reading them does not kill the editor with unsaved edits
+void originalFault(int sig, siginfo_t* info, void* context) {
+  (void)context;
+  char* addr = info->si_addr;
+  if (E.originalMapped && addr >= E.original && addr < E.original + E.originalSize) {
+    char* page = E.original + ((addr - E.original) & ~(E.pageSize - 1));
+    if (mmap(page, E.pageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      E.originalLost = 1;
+      return;
+    }
+  }
+  signal(sig, SIG_DFL);
+}
+
+// Read whole file that cannot be mapped, such as a pipe
+void readOriginal(int fd) {
+  size_t capacity = 65536;
+  char* buf = malloc(capacity);
+  size_t len = 0;
+  while (1) {
+    ssize_t n = read(fd, buf + len, capacity - len);
+    if (n == 0) break;
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      throw("read");
+    }
+    len += n;
+    if (len == capacity) buf = realloc(buf, capacity *= 2);
+  }
+  if (len == 0) {
+    free(buf);
+    return;
+  }
+  E.original = buf;
+  E.originalSize = len;
+}
+
+// Open file
+void openFile(char* filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+  selectSyntaxHighlight();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) throw("open");
+
+  // Map the file instead of reading it, rows are indexed and rendered
+  // only once they are needed. Pipes and files that report no size, like
+  // those in /proc, are read instead.
+  struct stat st;
+  if (fstat(fd, &st) == -1) throw("fstat");
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    E.original = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (E.original == MAP_FAILED) throw("mmap");
+    E.originalSize = st.st_size;
+    E.originalMapped = 1;
+    E.originalFd = fd;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = originalFault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) == -1) throw("sigaction");
+  } else {
+    readOriginal(fd);
+    close(fd);
+  }
+
+  E.indexed = 0;
+  loadRows(E.rows);
+  E.dirty = 0;
+}
+
+// Copy rows still in the original file into memory and unmap it, so that
+// the file can be written in place
+void detachOriginal() {
+  if (E.original == NULL) return;
+  loadRows(INT_MAX);
+  for (int at = 0; at < E.nrows; at++) {
+    if (isOriginal(getRow(at))) ownRow(editRow(at));
+  }
+  if (E.originalMapped) {
+    munmap(E.original, E.originalSize);
+    close(E.originalFd);
+  } else {
+    free(E.original);
+  }
+  E.original = NULL;
+  E.originalMapped = 0;
+  E.originalFd = -1;
+  E.originalSize = 0;
+  E.indexed = 0;
+}
+
+// Get size of the mapped file still on disk
+size_t originalValid() {
+  struct stat st;
+  if (!E.originalMapped || fstat(E.originalFd, &st) == -1) return E.originalSize;
+  return (size_t)st.st_size < E.originalSize ? (size_t)st.st_size : E.originalSize;
+}
+
+// Delete rows past the end of a file truncated on disk, as their text was
+// replaced by zeros, and stop indexing the rest
+void dropLostRows(size_t valid) {
+  for (int at = E.nrows - 1; at >= 0; at--) {
+    erow* row = getRow(at);
+    if (!isOriginal(row)) continue;
+    size_t start = row->chars - E.original;
+    if (start >= valid || start + row->size > valid) deleteRow(at);
+  }
+  E.indexed = E.originalSize;
+  E.originalLost = 2;
+  if (E.cy > E.nrows) E.cy = E.nrows;
+  erow* row = getRow(E.cy);
+  if (E.cx > (row ? row->size : 0)) E.cx = row ? row->size : 0;
+  setStatusMessage("File truncated on disk, lines past its end are lost");
+}
+
+// Save file
+void saveFile() {
+  if (E.save) {
+    setStatusMessage("Save in progress");
+    return;
+  }
+
+  if (E.filename == NULL) {
+    E.filename = prompt("Save as: %s (Esc to cancel)", NULL);
+    if (E.filename == NULL) {
+      setStatusMessage("Save aborted");
+      return;
+    }
+    selectSyntaxHighlight();
+  }
+
+  // Rows may still point into the mapped file, so write a new file next to
+  // the one a link points to and rename it into place, with the same owner
+  // and mode. Files that cannot be replaced like that, as they have other
+  // links or their directory is not writable, are written in place once
+  // the rows are copied out of the mapping.
+  size_t valid = originalValid();
+  if (valid < E.originalSize) dropLostRows(valid);
+  struct saveJob* job = calloc(1, sizeof(struct saveJob));
+  char* path = realpath(E.filename, NULL);
+  if (path == NULL) path = strdup(E.filename);
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+  job->fd = -1;
+  if (exists && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+    snprintf(job->tmp, sizeof(job->tmp), "%s.XXXXXX", path);
+    job->fd = mkstemp(job->tmp);
+    if (job->fd != -1 && (fchown(job->fd, st.st_uid, st.st_gid) == -1 || fchmod(job->fd, st.st_mode & 07777) == -1)) {
+      close(job->fd);
+      unlink(job->tmp);
+      job->fd = -1;
+    }
+  }
+  if (job->fd == -1) {
+    job->tmp[0] = '\0';
+    if (exists) detachOriginal();
+    job->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if (job->fd == -1) {
+    setStatusMessage("Cannot save! I/O error: %s", strerror(errno));
+    free(path);
+    free(job);
+    return;
+  }
+
+  // The thread writes a snapshot of the rows, so editing can go on
+  job->filename = path;
+  job->tree = E.tree;
+  if (job->tree) job->tree->refs++;
+  job->indexed = E.indexed;
+  job->needed = E.originalMapped ? valid : 0;
+  job->lost = E.originalLost;
+  job->total = E.nbytes + E.originalSize - E.indexed;
+  job->dirty = E.dirty;
+  pthread_mutex_init(&job->lock, NULL);
+  E.save = job;
+  if (pthread_create(&E.saveThread, NULL, saveThread, job) != 0) throw("pthread_create");
+  setStatusMessage("Saving...");
+}
+
+//// Regex ////
+
+// Patterns are parsed into a tree, compiled into a Thompson NFA program
+// and matched by a DFA whose states are sets of program positions. DFA
+// states are only built when the text first reaches them, so matching is
+// linear in the text without ever compiling the whole automaton. Where
+// trying each start would read the text too often, the program is run
+// back over the text instead, finding the longest match from every start.
+
+// Create regex tree node
+struct rxNode* rxNew(int type, struct rxNode* l, struct rxNode* r) {
+  struct rxNode* node = calloc(1, sizeof(struct rxNode));
+  node->type = type;
+  node->l = l;
+  node->r = r;
+  return node;
+}
+
+// Free regex tree
+void rxFree(struct rxNode* node) {
+  if (node == NULL) return;
+  rxFree(node->l);
+  rxFree(node->r);
+  free(node);
+}
+
+// Add byte range to character set
+void rxRange(unsigned char* set, int from, int to) {
+  for (int c = from; c <= to; c++) set[c >> 3] |= 1 << (c & 7);
+}
+
+// Fill character set for escape, returning 0 if it is a plain character
+int rxEscape(int c, unsigned char* set) {
+  int negate = isupper(c);
+  switch (tolower(c)) {
+    case 'd':
+      rxRange(set, '0', '9');
+      break;
+    case 'w':
+      rxRange(set, '0', '9');
+      rxRange(set, 'A', 'Z');
+      rxRange(set, 'a', 'z');
+      rxRange(set, '_', '_');
+      break;
+    case 's':
+      rxRange(set, '\t', '\r');
+      rxRange(set, ' ', ' ');
+      break;
+    default:
+      if (c == 't') c = '\t';
+      rxRange(set, c, c);
+      return 0;
+  }
+  if (negate) for (int i = 0; i < 32; i++) set[i] = ~set[i];
+  return 1;
+}
+
+// Parse bracket expression after its opening bracket
+struct rxNode* rxClass(struct rxParser* p) {
+  struct rxNode* node = rxNew(RN_SET, NULL, NULL);
+  int negate = (*p->s == '^');
+  if (negate) p->s++;
+
+  const char* start = p->s;
+  while (*p->s && (*p->s != ']' || p->s == start)) {
+    int c = (unsigned char)*p->s++;
+    if (c == '\\' && *p->s) {
+      int e = (unsigned char)*p->s++;
+      if (rxEscape(e, node->set)) continue;
+      c = (e == 't') ? '\t' : e;
+    }
+    if (p->s[0] == '-' && p->s[1] && p->s[1] != ']') {
+      int to = (unsigned char)p->s[1];
+      p->s += 2;
+      if (to == '\\' && *p->s) to = (unsigned char)*p->s++;
+      if (to < c) {
+        p->error = "bad range";
+        return node;
+      }
+      rxRange(node->set, c, to);
+    } else {
+      rxRange(node->set, c, c);
+    }
+  }
+  if (*p->s != ']') {
+    p->error = "missing ]";
+    return node;
+  }
+  p->s++;
+  if (negate) for (int i = 0; i < 32; i++) node->set[i] = ~node->set[i];
+  return node;
+}
+
+struct rxNode* rxAlternation(struct rxParser* p);
+
+// Parse single character, class, anchor or group
+struct rxNode* rxAtom(struct rxParser* p) {
+  int c = (unsigned char)*p->s++;
+  struct rxNode* node;
+  switch (c) {
+    case '(':
+      node = rxAlternation(p);
+      if (*p->s != ')') {
+        if (!p->error) p->error = "missing )";
+        return node;
+      }
+      p->s++;
+      return node;
+    case '[':
+      return rxClass(p);
+    case '.':
+      node = rxNew(RN_SET, NULL, NULL);
+      rxRange(node->set, 0, 255);
+      return node;
+    case '^':
+      return rxNew(RN_BOL, NULL, NULL);
+    case '$':
+      return rxNew(RN_EOL, NULL, NULL);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      p->error = "nothing to repeat";
+      return NULL;
+    case '\\':
+      if (*p->s == '\0') {
+        p->error = "trailing \\";
+        return NULL;
+      }
+      c = (unsigned char)*p->s++;
+      node = rxNew(RN_SET, NULL, NULL);
+      rxEscape(c, node->set);
+      return node;
+    default:
+      node = rxNew(RN_SET, NULL, NULL);
+      rxRange(node->set, c, c);
+      return node;
+  }
+}
+
+// Parse repeat count
+int rxCount(struct rxParser* p) {
+  if (!isdigit((unsigned char)*p->s)) return -1;
+  int n = 0;
+  while (isdigit((unsigned char)*p->s)) {
+    n = n * 10 + (*p->s++ - '0');
+    if (n > RX_REPEAT) n = RX_REPEAT + 1;
+  }
+  return n;
+}
+
+// Parse atom and the quantifiers after it
+struct rxNode* rxRepeat(struct rxParser* p) {
+  struct rxNode* node = rxAtom(p);
+  while (!p->error) {
+    int min, max;
+    if (*p->s == '*') {
+      min = 0;
+      max = -1;
+    } else if (*p->s == '+') {
+      min = 1;
+      max = -1;
+    } else if (*p->s == '?') {
+      min = 0;
+      max = 1;
+    } else if (*p->s == '{') {
+      p->s++;
+      min = max = rxCount(p);
+      if (*p->s == ',') {
+        p->s++;
+        max = (*p->s == '}') ? -1 : rxCount(p);
+        if (max == -1 && *p->s != '}') min = -1;
+      }
+      if (min < 0 || *p->s != '}' || min > RX_REPEAT || max > RX_REPEAT || (max >= 0 && max < min)) {
+        p->error = "bad repeat";
+        return node;
+      }
+    } else {
+      break;
+    }
+    p->s++;
+    node = rxNew(RN_REPEAT, node, NULL);
+    node->min = min;
+    node->max = max;
+  }
+  return node;
+}
+
+// Parse sequence of repeats
+struct rxNode* rxConcat(struct rxParser* p) {
+  struct rxNode* node = rxNew(RN_EMPTY, NULL, NULL);
+  while (*p->s && *p->s != '|' && *p->s != ')' && !p->error) {
+    node = rxNew(RN_CAT, node, rxRepeat(p));
+  }
+  return node;
+}
+
+// Parse alternatives
+struct rxNode* rxAlternation(struct rxParser* p) {
+  struct rxNode* node = rxConcat(p);
+  while (*p->s == '|' && !p->error) {
+    p->s++;
+    node = rxNew(RN_ALT, node, rxConcat(p));
+  }
+  return node;
+}
+
+// Add instruction to regex program
+int rxEmitInst(struct regex* re, int op) {
+  if (re->n == RX_INSTS) {
+    re->error = "pattern too large";
+    return RX_INSTS - 1;
+  }
+  memset(&re->prog[re->n], 0, sizeof(struct rxInst));
+  re->prog[re->n].op = op;
+  return re->n++;
+}
+
+// Compile regex tree into program
+void rxEmit(struct regex* re, struct rxNode* node) {
+  if (re->error) return;
+  int split, jump;
+  switch (node->type) {
+    case RN_SET:
+      memcpy(re->prog[rxEmitInst(re, RX_SET)].set, node->set, 32);
+      break;
+    case RN_BOL:
+      rxEmitInst(re, RX_BOL);
+      break;
+    case RN_EOL:
+      rxEmitInst(re, RX_EOL);
+      break;
+    case RN_CAT:
+      rxEmit(re, node->l);
+      rxEmit(re, node->r);
+      break;
+    case RN_ALT:
+      split = rxEmitInst(re, RX_SPLIT);
+      re->prog[split].x = re->n;
+      rxEmit(re, node->l);
+      jump = rxEmitInst(re, RX_JUMP);
+      re->prog[split].y = re->n;
+      rxEmit(re, node->r);
+      re->prog[jump].x = re->n;
+      break;
+    case RN_REPEAT:
+      for (int i = 0; i < node->min; i++) rxEmit(re, node->l);
+      if (node->max < 0) {
+        split = rxEmitInst(re, RX_SPLIT);
+        re->prog[split].x = re->n;
+        rxEmit(re, node->l);
+        re->prog[rxEmitInst(re, RX_JUMP)].x = split;
+        re->prog[split].y = re->n;
+      } else {
+        // Optional copies skip straight past the last one
+        int first = re->n;
+        for (int i = node->min; i < node->max && !re->error; i++) {
+          split = rxEmitInst(re, RX_SPLIT);
+          re->prog[split].x = re->n;
+          rxEmit(re, node->l);
+        }
+        for (int pc = first; pc < re->n && !re->error; pc++) {
+          if (re->prog[pc].op == RX_SPLIT && re->prog[pc].y == 0) re->prog[pc].y = re->n;
+        }
+      }
+      break;
+  }
+}
+
+// Get the only character in set, or -1
+int rxSingle(unsigned char* set) {
+  int c = -1;
+  for (int i = 0; i < 256; i++) {
+    if (!(set[i >> 3] & (1 << (i & 7)))) continue;
+    if (c >= 0) return -1;
+    c = i;
+  }
+  return c;
+}
+
+// Find the longest run of characters in the top level sequence of the
+// tree, which every match has to contain
+void rxLiteral(struct regex* re, struct rxNode* node, char* run, int* len) {
+  if (node->type == RN_CAT) {
+    rxLiteral(re, node->l, run, len);
+    rxLiteral(re, node->r, run, len);
+    return;
+  }
+  if (node->type == RN_EMPTY) return;
+
+  int c = (node->type == RN_SET) ? rxSingle(node->set) : -1;
+  if (c < 0 || c == '\n' || c == '\r' || *len == RX_LITERAL) {
+    *len = 0;
+    return;
+  }
+  run[(*len)++] = c;
+  if (*len > re->literalLen) {
+    memcpy(re->literal, run, *len);
+    re->literalLen = *len;
+  }
+}
+
+// Compile pattern into regex, returning an error message on failure
+const char* compileRegex(struct regex* re, const char* pattern) {
+  struct rxParser p = { pattern, NULL };
+  struct rxNode* tree = rxAlternation(&p);
+  if (p.error == NULL && *p.s == ')') p.error = "unmatched )";
+
+  re->prog = malloc(RX_INSTS * sizeof(struct rxInst));
+  re->n = 0;
+  re->error = p.error;
+  re->literalLen = 0;
+  if (re->error == NULL) {
+    char run[RX_LITERAL];
+    int len = 0;
+    rxLiteral(re, tree, run, &len);
+    rxEmit(re, tree);
+    rxEmitInst(re, RX_MATCH);
+  }
+  rxFree(tree);
+  if (re->error) {
+    free(re->prog);
+    re->prog = NULL;
+  }
+  return re->error;
+}
+
+// Free regex program
+void freeRegex(struct regex* re) {
+  free(re->prog);
+  re->prog = NULL;
+}
+
+// Add program position and the positions reachable from it without
+// reading a character to the DFA work set. Line end assertions are kept
+// in the set to be resolved once the end of the line is reached.
+void dfaClosure(struct dfa* d, int pc, int flags) {
+  if (d->mark[pc] == d->generation) return;
+  d->mark[pc] = d->generation;
+  struct rxInst* inst = &d->re->prog[pc];
+  switch (inst->op) {
+    case RX_SPLIT:
+      dfaClosure(d, inst->x, flags);
+      dfaClosure(d, inst->y, flags);
+      break;
+    case RX_JUMP:
+      dfaClosure(d, inst->x, flags);
+      break;
+    case RX_BOL:
+      if (flags & RX_AT_BOL) dfaClosure(d, pc + 1, flags);
+      break;
+    case RX_EOL:
+      if (flags & RX_AT_EOL) dfaClosure(d, pc + 1, flags);
+      else d->work[d->nwork++] = pc;
+      break;
+    default:
+      d->work[d->nwork++] = pc;
+      break;
+  }
+}
+
+// Compare program positions
+int comparePositions(const void* a, const void* b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+// Drop all DFA states once the cache is full
+void dfaFlush(struct dfa* d) {
+  for (int i = 0; i < d->nstates; i++) free(d->states[i].pcs);
+  d->nstates = 0;
+  for (int i = 0; i < RX_HASH; i++) d->table[i] = -1;
+  d->start[0] = d->start[1] = -1;
+  d->flushes++;
+}
+
+// Get DFA state for the positions in the work set, building it if new
+int dfaState(struct dfa* d) {
+  qsort(d->work, d->nwork, sizeof(int), comparePositions);
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < d->nwork; i++) hash = (hash ^ d->work[i]) * 16777619u;
+
+  int slot = hash & (RX_HASH - 1);
+  for (int s; (s = d->table[slot]) >= 0; slot = (slot + 1) & (RX_HASH - 1)) {
+    if (d->states[s].n == d->nwork && memcmp(d->states[s].pcs, d->work, d->nwork * sizeof(int)) == 0) return s;
+  }
+
+  if (d->nstates == RX_STATES) {
+    dfaFlush(d);
+    return dfaState(d);
+  }
+  if (d->nstates == d->capacity) {
+    d->capacity = d->capacity ? d->capacity * 2 : 16;
+    d->states = realloc(d->states, d->capacity * sizeof(struct dfaState));
+  }
+
+  int s = d->nstates++;
+  struct dfaState* state = &d->states[s];
+  state->pcs = malloc(d->nwork * sizeof(int) + 1);
+  memcpy(state->pcs, d->work, d->nwork * sizeof(int));
+  state->n = d->nwork;
+  state->match = 0;
+  state->matchAtEnd = 0;
+  for (int c = 0; c < 256; c++) state->next[c] = -1;
+  d->table[slot] = s;
+
+  // Matches before the next character, or once line end assertions hold
+  for (int i = 0; i < state->n; i++) {
+    if (d->re->prog[state->pcs[i]].op == RX_MATCH) state->match = 1;
+  }
+  d->generation++;
+  d->nwork = 0;
+  for (int i = 0; i < state->n; i++) {
+    if (d->re->prog[state->pcs[i]].op == RX_EOL) dfaClosure(d, state->pcs[i], RX_AT_EOL);
+  }
+  for (int i = 0; i < d->nwork; i++) {
+    if (d->re->prog[d->work[i]].op == RX_MATCH) state->matchAtEnd = 1;
+  }
+  state->matchAtEnd |= state->match;
+  return s;
+}
+
+// Get DFA start state
+int dfaStart(struct dfa* d, int bol) {
+  if (d->start[bol] >= 0) return d->start[bol];
+  d->generation++;
+  d->nwork = 0;
+  dfaClosure(d, 0, bol ? RX_AT_BOL : 0);
+  int s = dfaState(d);
+  d->start[bol] = s;
+  return s;
+}
+
+// Build DFA state reached after reading character
+int dfaNext(struct dfa* d, int s, unsigned char c) {
+  d->generation++;
+  d->nwork = 0;
+  struct dfaState* state = &d->states[s];
+  for (int i = 0; i < state->n; i++) {
+    struct rxInst* inst = &d->re->prog[state->pcs[i]];
+    if (inst->op == RX_SET && (inst->set[c >> 3] & (1 << (c & 7)))) dfaClosure(d, state->pcs[i] + 1, 0);
+  }
+  if (d->unanchored) dfaClosure(d, 0, 0);
+
+  // A flush drops the state being left, so its transition is not kept
+  int flushes = d->flushes;
+  int next = dfaState(d);
+  if (d->flushes == flushes) d->states[s].next[c] = next;
+  return next;
+}
+
+// Create DFA for regex
+void initDfa(struct dfa* d, struct regex* re, int unanchored) {
+  d->re = re;
+  d->unanchored = unanchored;
+  d->states = NULL;
+  d->nstates = 0;
+  d->capacity = 0;
+  d->flushes = 0;
+  d->mark = calloc(re->n, sizeof(int));
+  d->work = malloc(re->n * sizeof(int));
+  d->generation = 0;
+  d->nwork = 0;
+  dfaFlush(d);
+}
+
+// Free DFA
+void freeDfa(struct dfa* d) {
+  dfaFlush(d);
+  free(d->states);
+  free(d->mark);
+  free(d->work);
+}
+
+// Find ends of the longest matches from each program position at text
+// position into cur, or -1, from those at the next position in next. Moves
+// that read no character are followed until no end grows, as loops may
+// lead back to positions already done.
+void rxBack(struct regex* re, char* s, int len, int at, int* next, int* cur) {
+  unsigned char c = at < len ? s[at] : 0;
+  for (int pc = re->n - 1; pc >= 0; pc--) {
+    struct rxInst* inst = &re->prog[pc];
+    cur[pc] = -1;
+    if (inst->op == RX_MATCH) cur[pc] = at;
+    else if (inst->op == RX_SET && at < len && (inst->set[c >> 3] & (1 << (c & 7)))) cur[pc] = next[pc + 1];
+  }
+  for (int changed = 1; changed; ) {
+    changed = 0;
+    for (int pc = re->n - 1; pc >= 0; pc--) {
+      struct rxInst* inst = &re->prog[pc];
+      int e = -1;
+      if (inst->op == RX_SPLIT) e = cur[inst->x] > cur[inst->y] ? cur[inst->x] : cur[inst->y];
+      else if (inst->op == RX_JUMP) e = cur[inst->x];
+      else if (inst->op == RX_BOL && at == 0) e = cur[pc + 1];
+      else if (inst->op == RX_EOL && at == len) e = cur[pc + 1];
+      if (e > cur[pc]) {
+        cur[pc] = e;
+        changed = 1;
+      }
+    }
+  }
+}
+
+// Check if regex matches empty text at line start or elsewhere
+int rxNullable(struct rxMatcher* m) {
+  for (int at = 0; at < 2; at++) {
+    rxBack(m->re, "", at, at, NULL, m->longest[0]);
+    if (m->longest[0][0] == at) return 1;
+  }
+  return 0;
+}
+
+// Create matcher for regex, with DFA cache and match ends owned by one thread
+void initMatcher(struct rxMatcher* m, struct regex* re) {
+  m->re = re;
+  initDfa(&m->anchored, re, 0);
+  initDfa(&m->search, re, 1);
+  for (int k = 0; k < 2; k++) m->longest[k] = malloc(re->n * sizeof(int));
+
+  // Blocks are long enough that the ends kept for them take no more
+  // memory than the text
+  m->blockSize = re->n * (int)sizeof(int) > RX_BLOCK ? re->n * (int)sizeof(int) : RX_BLOCK;
+  m->ends = malloc(m->blockSize * sizeof(int));
+  m->saved = NULL;
+  m->savedCapacity = 0;
+  m->text = NULL;
+  m->len = 0;
+  m->scanFrom = -1;
+  m->nullable = rxNullable(m);
+}
+
+// Free matcher
+void freeMatcher(struct rxMatcher* m) {
+  freeDfa(&m->anchored);
+  freeDfa(&m->search);
+  for (int k = 0; k < 2; k++) free(m->longest[k]);
+  free(m->ends);
+  free(m->saved);
+}
+
+// Get end of longest match starting at position, or -1, or -2 once the
+// budget of characters to read runs out
+int rxLongest(struct dfa* d, char* s, int len, int from, int* budget) {
+  int state = dfaStart(d, from == 0);
+  int last = -1;
+  for (int i = from; ; i++) {
+    struct dfaState* ds = &d->states[state];
+    if (ds->n == 0) break;
+    if (ds->match) last = i;
+    if (i == len) {
+      if (ds->matchAtEnd) last = len;
+      break;
+    }
+    if (--*budget < 0) return -2;
+    int next = ds->next[(unsigned char)s[i]];
+    state = (next >= 0) ? next : dfaNext(d, state, s[i]);
+  }
+  return last;
+}
+
+// Get end of earliest match starting at or after position, or -1
+int rxEarliest(struct dfa* d, char* s, int len, int from) {
+  int state = dfaStart(d, from == 0);
+  for (int i = from; i < len; i++) {
+    struct dfaState* ds = &d->states[state];
+    if (ds->match) return i;
+    int next = ds->next[(unsigned char)s[i]];
+    state = (next >= 0) ? next : dfaNext(d, state, s[i]);
+  }
+  return d->states[state].matchAtEnd ? len : -1;
+}
+
+// Go back over text from its end to position once, keeping the longest
+// match ends from every program position at the end of each block after
+// position, so a block can be gone over again to find the longest match
+// end from each of its characters
+void rxScan(struct rxMatcher* m, char* s, int len, int from) {
+  int n = m->re->n;
+  size_t size = (size_t)((len - from + m->blockSize - 1) / m->blockSize) * n;
+  if (size > m->savedCapacity) {
+    m->savedCapacity = size;
+    m->saved = realloc(m->saved, size * sizeof(int));
+  }
+  int k = 0;
+  for (int at = len; at >= from; at--) {
+    rxBack(m->re, s, len, at, m->longest[!k], m->longest[k]);
+    if (at > from && ((at - from) % m->blockSize == 0 || at == len)) {
+      memcpy(&m->saved[(size_t)((at - from - 1) / m->blockSize) * n], m->longest[k], n * sizeof(int));
+    }
+    k = !k;
+  }
+  m->scanFrom = from;
+  m->block = -1;
 }
 
-// Convert render index to character index
-int renderToCharacter(erow* row, int rx) {
-  int cur = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t') cur += (TAB_STOP - 1) - (cur % TAB_STOP);
-    cur++;
-    if (cur > rx) return cx;
+// Find leftmost longest non-empty match at or after position, after the
+// text was gone over back to it, going over each block again once
+int rxScanned(struct rxMatcher* m, char* s, int len, int from, int* start, int* end) {
+  int n = m->re->n;
+  for (int i = from; i < len; i++) {
+    int b = (i - m->scanFrom) / m->blockSize;
+    int first = m->scanFrom + b * m->blockSize;
+    if (b != m->block) {
+      int at = len - first > m->blockSize ? first + m->blockSize : len;
+      int k = 0;
+      memcpy(m->longest[!k], &m->saved[(size_t)b * n], n * sizeof(int));
+      while (--at >= first) {
+        rxBack(m->re, s, len, at, m->longest[!k], m->longest[k]);
+        m->ends[at - first] = m->longest[k][0];
+        k = !k;
+      }
+      m->block = b;
+    }
+    if (m->ends[i - first] > i) {
+      *start = i;
+      *end = m->ends[i - first];
+      return 1;
+    }
   }
-  return cx;
+  return 0;
 }
 
-// Update row
-void updateRow(erow* row) {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') tabs++;
+// Find leftmost longest non-empty match in text at or after position. The
+// earliest match end bounds where the leftmost match can start. Starts are
+// tried with the anchored DFA while it has read the row a few times at most
+// over all searches in it, which begin at its start. Then the rest of the
+// row is gone over back once and each block again, so the search of a row
+// stays linear.
+int rxSearch(struct rxMatcher* m, char* s, int len, int from, int* start, int* end) {
+  if (from == 0 || s != m->text || len != m->len) {
+    m->text = s;
+    m->len = len;
+    m->budget = RX_BUDGET * (len + 1);
+    m->scanFrom = -1;
   }
+  if (m->scanFrom >= 0 && from >= m->scanFrom) return rxScanned(m, s, len, from, start, end);
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
+  int last = len - 1;
+  if (!m->nullable) {
+    int e = rxEarliest(&m->search, s, len, from);
+    if (e < 0) return 0;
+    last = e - 1;
+  }
 
-  int i = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[i++] = ' ';
-      while (i % TAB_STOP != 0) row->render[i++] = ' ';
-    } else {
-      row->render[i++] = row->chars[j];
+  for (int i = from; i <= last; i++) {
+    int e = rxLongest(&m->anchored, s, len, i, &m->budget);
+    if (e == -2) {
+      rxScan(m, s, len, i);
+      return rxScanned(m, s, len, i, start, end);
+    }
+    if (e > i) {
+      *start = i;
+      *end = e;
+      return 1;
     }
   }
-  row->render[i] = '\0';
-  row->rsize = i;
-  updateSyntax(row);
+  return 0;
 }
 
-// Insert row
-void insertRow(int at, char* s, size_t len) {
-  if (at < 0 || at > E.nrows) return;
-  E.row = realloc(E.row, sizeof(erow) * (E.nrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.nrows - at));
-  for (int j = at + 1; j <= E.nrows; j++) E.row[j].index++;
-
-  E.row[at].index = at;
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hlOpenComment = 0;
-  updateRow(&E.row[at]);
-
-  E.nrows++;
-  E.dirty++;
-}
+//// Find ////
 
-// Free row
-void freeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+// Find text in buffer, comparing the first and last bytes of the query
+// over 16 positions at a time before checking candidates in full
+char* findText(char* s, size_t len, char* q, size_t qlen) {
+  if (qlen == 0 || qlen > len) return NULL;
+  if (qlen == 1) return memchr(s, q[0], len);
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(q[0]);
+  __m128i last = _mm_set1_epi8(q[qlen - 1]);
+  size_t i = 0;
+  for (; i + qlen - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((__m128i*)&s[i]);
+    __m128i b = _mm_loadu_si128((__m128i*)&s[i + qlen - 1]);
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(&s[i + bit + 1], &q[1], qlen - 2) == 0) return &s[i + bit];
+      mask &= mask - 1;
+    }
+  }
+  return memmem(&s[i], len - i, q, qlen);
+#else
+  return memmem(s, len, q, qlen);
+#endif
 }
 
-// Delete row
-void deleteRow(int at) {
-  if (at < 0 || at >= E.nrows) return;
-  freeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.nrows - at - 1));
-  for (int j = at; j < E.nrows - 1; j++) E.row[j].index--;
-  E.nrows--;
-  E.dirty++;
+// Check if text is a single line ending, so rows around it are adjacent
+int isLineBreak(char* s, char* end) {
+  if (s >= end || end[-1] != '\n') return 0;
+  for (; s < end - 1; s++) if (*s != '\r') return 0;
+  return 1;
 }
 
-// Insert character to row
-void rowInsertCharacter(erow* row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  if (E.insert == 0 || at == row->size) {
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], ++row->size - at);
-  }
-  row->chars[at] = c;
-  updateRow(row);
-  E.dirty++;
+// Get a chunk of at most limit rows that are contiguous in the original
+// file buffer, starting at row, and return the row after it. Queries never
+// hold line endings, so matches found in a chunk never span rows.
+erow* nextChunk(struct riter* it, erow* row, int limit, char** start, char** end, int* nrows) {
+  *start = row->chars;
+  *end = row->chars + row->size;
+  *nrows = 1;
+  erow* next;
+  while ((next = nextRow(it)) && *nrows < limit && isOriginal(row) && isOriginal(next) && isLineBreak(*end, next->chars)) {
+    *end = next->chars + next->size;
+    (*nrows)++;
+    row = next;
+  }
+  return next;
 }
 
-// Append string
-void appendString(erow* row, char* s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  updateRow(row);
-  E.dirty++;
+// Make room for n more matches in list
+void reserveMatches(struct matchList* list, int n) {
+  if (list->count + n <= list->capacity) return;
+  while (list->count + n > list->capacity) list->capacity = list->capacity ? list->capacity * 2 : 64;
+  list->items = realloc(list->items, list->capacity * sizeof(struct match));
 }
 
-// Delete character from row
-void rowDeleteCharacter(erow* row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size-- - at);
-  updateRow(row);
-  E.dirty++;
+// Add match to list
+void addMatch(struct matchList* list, int row, int col, int len) {
+  reserveMatches(list, 1);
+  list->items[list->count].row = row;
+  list->items[list->count].col = col;
+  list->items[list->count].len = len;
+  list->count++;
 }
 
-//// Editor ////
+// Search rows for indexed query, adding matches to list in order. Regex
+// queries are matched with the given matcher, only on rows holding the
+// literal every match of the regex contains.
+void searchRows(int first, int nrows, struct rxMatcher* m, struct matchList* list) {
+  struct riter it;
+  erow* r = iterRows(&it, first);
+  int at = first;
+  char* q = m ? m->re->literal : E.search.query;
+  size_t qlen = m ? (size_t)m->re->literalLen : strlen(q);
+  if (m && qlen == 0) {
+    for (; r && at < first + nrows; r = nextRow(&it), at++) {
+      int start, end;
+      for (int col = 0; rxSearch(m, r->chars, r->size, col, &start, &end); col = end) {
+        addMatch(list, at, start, end - start);
+      }
+    }
+    return;
+  }
 
-// Insert character
-void insertCharacter(int c) {
-  if (c == CTRL_KEY(c)) return;
-  if (E.cy == E.nrows) insertRow(E.nrows, "", 0);
-  rowInsertCharacter(&E.row[E.cy], E.cx++, c);
-  resetCursor();
-}
+  while (r && at < first + nrows) {
+    char *start, *end;
+    int n;
+    r = nextChunk(&it, r, first + nrows - at, &start, &end, &n);
+
+    // Matches are placed in rows by counting the line breaks before them
+    int row = at;
+    char* line = start;
+    char* p = start;
+    while ((p = findText(p, end - p, q, qlen))) {
+      char* nl;
+      while ((nl = memchr(line, '\n', p - line))) {
+        row++;
+        line = nl + 1;
+      }
+      if (m == NULL) {
+        addMatch(list, row, p - line, qlen);
+        p += qlen;
+        continue;
+      }
 
-// Insert line
-void insertLine() {
-  if (E.cx == 0) {
-    insertRow(E.cy, "", 0);
-  } else {
-    erow* row = &E.row[E.cy];
-    insertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    updateRow(row);
+      // Line endings between rows in a chunk are not part of either row
+      nl = memchr(p, '\n', end - p);
+      char* rowEnd = nl ? nl : end;
+      while (nl && rowEnd > line && rowEnd[-1] == '\r') rowEnd--;
+      int s, e;
+      for (int col = 0; rxSearch(m, line, rowEnd - line, col, &s, &e); col = e) addMatch(list, row, s, e - s);
+      if (nl == NULL) break;
+      p = nl + 1;
+    }
+    at += n;
   }
-  E.cy++;
-  E.cx = 0;
 }
 
-// Delete character
-void deleteCharacter() {
-  if (E.cy == E.nrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
+// Search slice of rows on worker thread
+void* searchThread(void* arg) {
+  struct findSlice* slice = arg;
+  struct rxMatcher m;
+  if (E.search.regex) initMatcher(&m, &E.search.re);
+  searchRows(slice->first, slice->nrows, E.search.regex ? &m : NULL, &slice->list);
+  if (E.search.regex) freeMatcher(&m);
+  return NULL;
+}
 
-  erow* row = &E.row[E.cy];
-  if (E.cx > 0) {
-    rowDeleteCharacter(row, --E.cx);
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    appendString(&E.row[E.cy - 1], row->chars, row->size);
-    deleteRow(E.cy--);
+// Build match index for query, splitting rows across worker threads.
+// Returns an error message if the query is not a valid regex.
+const char* buildIndex(char* query, int regex) {
+  free(E.search.query);
+  freeRegex(&E.search.re);
+  E.search.query = NULL;
+  E.search.list.count = 0;
+  E.search.ndirty = 0;
+  E.search.stale = 0;
+  if (regex && compileRegex(&E.search.re, query)) return E.search.re.error;
+  E.search.query = strdup(query);
+  E.search.regex = regex;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = E.nrows / FIND_SLICE;
+  if (nthreads > cpus) nthreads = cpus;
+  if (nthreads > FIND_THREADS) nthreads = FIND_THREADS;
+  if (nthreads <= 1) {
+    struct findSlice slice = { 0, E.nrows, E.search.list, 0 };
+    searchThread(&slice);
+    E.search.list = slice.list;
+    return NULL;
   }
-  resetCursor();
+
+  // Slices are searched in parallel and joined in row order
+  struct findSlice slices[FIND_THREADS];
+  for (int i = 0; i < nthreads; i++) {
+    slices[i].first = (long)E.nrows * i / nthreads;
+    slices[i].nrows = (long)E.nrows * (i + 1) / nthreads - slices[i].first;
+    slices[i].list = (struct matchList){ NULL, 0, 0 };
+    if (pthread_create(&slices[i].thread, NULL, searchThread, &slices[i]) != 0) throw("pthread_create");
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(slices[i].thread, NULL);
+    reserveMatches(&E.search.list, slices[i].list.count);
+    memcpy(&E.search.list.items[E.search.list.count], slices[i].list.items, slices[i].list.count * sizeof(struct match));
+    E.search.list.count += slices[i].list.count;
+    free(slices[i].list.items);
+  }
+  return NULL;
 }
 
-//// File ////
+// Narrow match index to a query extending the indexed one. Only rows that
+// matched the shorter query can match the longer one, so only they are
+// searched again.
+void narrowIndex(char* query) {
+  // When most rows are candidates the parallel chunked search is faster
+  if (E.search.list.count > E.nrows / 4) {
+    buildIndex(query, 0);
+    return;
+  }
 
-// Stringify rows
-char* stringify(int* len) {
-  int size = 0;
-  for (int j = 0; j < E.nrows; j++) size += E.row[j].size + 1;
-  *len = size;
+  struct matchList candidates = E.search.list;
+  free(E.search.query);
+  E.search.query = strdup(query);
+  E.search.list = (struct matchList){ NULL, 0, 0 };
 
-  char* buf = malloc(size);
-  char* p = buf;
-  for (int j = 0; j < E.nrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+  for (int i = 0; i < candidates.count; i++) {
+    int row = candidates.items[i].row;
+    if (i > 0 && row == candidates.items[i - 1].row) continue;
+    searchRows(row, 1, NULL, &E.search.list);
   }
-
-  return buf;
+  free(candidates.items);
 }
 
-// Display file size
-char* displayFileSize() {
-  int len;
-  stringify(&len);
-
-  double size = len;
-  char* unit = "B";
-  if (size >= 1000) { size /= 1024; unit = "KB"; }
-  if (size >= 1000) { size /= 1024; unit = "MB"; }
-  if (size >= 1000) { size /= 1024; unit = "GB"; }
-  static char str[80];
-  snprintf(str, sizeof(str), len < 1000 ? "%.0f %s" : "%.02f %s", size, unit);
-  return str;
+// Get index of first match at or after position
+int lowerMatch(int row, int col) {
+  int lo = 0, hi = E.search.list.count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    struct match m = E.search.list.items[mid];
+    if (m.row < row || (m.row == row && m.col < col)) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
 }
 
-// Open file
-void openFile(char* filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-  selectSyntaxHighlight();
-
-  FILE* fp = fopen(filename, "r");
-  if (!fp) throw("fopen");
-
-  char* line = NULL;
-  size_t cap = 0;
-  ssize_t len;
-  while ((len = getline(&line, &cap, fp)) != -1) {
-    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
-    insertRow(E.nrows, line, len);
+// Rescan rows edited since the match index was built
+void refreshIndex() {
+  if (E.search.stale) {
+    char* query = strdup(E.search.query);
+    buildIndex(query, E.search.regex);
+    free(query);
+    return;
   }
-
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  if (E.search.ndirty == 0) return;
+
+  struct matchList found = { NULL, 0, 0 };
+  struct rxMatcher m;
+  if (E.search.regex) initMatcher(&m, &E.search.re);
+  for (int i = 0; i < E.search.ndirty; i++) {
+    int at = E.search.dirty[i];
+    found.count = 0;
+    searchRows(at, 1, E.search.regex ? &m : NULL, &found);
+    if (found.count == 0) continue;
+
+    struct matchList* list = &E.search.list;
+    int pos = lowerMatch(at, 0);
+    reserveMatches(list, found.count);
+    memmove(&list->items[pos + found.count], &list->items[pos], (list->count - pos) * sizeof(struct match));
+    memcpy(&list->items[pos], found.items, found.count * sizeof(struct match));
+    list->count += found.count;
+  }
+  free(found.items);
+  if (E.search.regex) freeMatcher(&m);
+  E.search.ndirty = 0;
 }
 
-// Save file
-void saveFile() {
-  if (E.filename == NULL) {
-    E.filename = prompt("Save as: %s (Esc to cancel)", NULL);
-    if (E.filename == NULL) {
-      setStatusMessage("Save aborted");
-      return;
-    }
-    selectSyntaxHighlight();
+// Update match index after row at changed, after delta rows were inserted
+// there when delta is positive, or after it was deleted when delta is -1.
+// Matches of the row are dropped and changed rows are rescanned on the next
+// search, while rows below only shift.
+void invalidateMatches(int at, int delta) {
+  if (E.search.query == NULL || E.search.stale) return;
+  struct matchList* list = &E.search.list;
+  int from = lowerMatch(at, 0);
+  int to = (delta > 0) ? from : lowerMatch(at + 1, 0);
+  memmove(&list->items[from], &list->items[to], (list->count - to) * sizeof(struct match));
+  list->count -= to - from;
+
+  // Edits within a row leave the rows below where they were
+  if (delta != 0) {
+    for (int i = from; i < list->count; i++) list->items[i].row += delta;
   }
 
-  int len;
-  char* buf = stringify(&len);
-
-  int file = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (file != -1) {
-    if (ftruncate(file, len) != -1 && write(file, buf, len) == len) {
-      close(file);
-      free(buf);
-      E.dirty = 0;
-      setStatusMessage("File saved successfully");
-      return;
-    }
-    close(file);
+  int n = 0;
+  for (int i = 0; i < E.search.ndirty; i++) {
+    int row = E.search.dirty[i];
+    if (row == at && delta <= 0) continue;
+    E.search.dirty[n++] = (row >= at + (delta < 0)) ? row + delta : row;
+  }
+  E.search.ndirty = n;
+  if (delta < 0) return;
+  for (int i = 0; i < n; i++) if (E.search.dirty[i] == at) return;
+
+  // Too many edited rows are cheaper to search again from scratch
+  int count = delta > 0 ? delta : 1;
+  if (n + count > FIND_DIRTY) {
+    E.search.stale = 1;
+    return;
   }
-  free(buf);
-  setStatusMessage("Cannot save! I/O error: %s", strerror(errno));
+  for (int row = at; row < at + count; row++) E.search.dirty[E.search.ndirty++] = row;
 }
 
-//// Find ////
+// Move cursor to match in index
+void gotoMatch(int i) {
+  struct match m = E.search.list.items[i];
+  E.cy = m.row;
+  E.cx = m.col;
+  E.dy = E.nrows;
+  setStatusMessage("%s: %s (match %d of %d)", E.search.regex ? "Regex" : "Search", E.search.query, i + 1, E.search.list.count);
+}
 
-// Find callback
-void findCallback(char* query, int key) {
-  static int lastMatch = -1;
-  static int direction = 1;
+// Search callback for literal or regex queries
+void searchCallback(char* query, int key, int regex) {
+  static int current = -1;
   static int savedHlLine;
-  static char* savedHl = NULL;
+  static int savedFrom, savedTo;
+  static unsigned char* savedHl = NULL;
 
+  // Restore the highlight under the match, unless a long row was
+  // highlighted again for another view
   if (savedHl) {
-    memcpy(E.row[savedHlLine].hl, savedHl, E.row[savedHlLine].rsize);
+    erow* row = getRow(savedHlLine);
+    int from, to;
+    rowRuns(row, &from, &to);
+    if (from == savedFrom && to == savedTo) {
+      loadSpans(savedHl, from, to);
+      storeHighlight(row);
+    }
     free(savedHl);
     savedHl = NULL;
   }
 
   if (key == '\r' || key == '\x1b') {
-    lastMatch = -1;
-    direction = 1;
+    current = -1;
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
+  }
+
+  // A changed query is indexed in one pass and goes to the first match,
+  // arrows step through the index from the current one
+  int dir = (key == ARROW_LEFT || key == ARROW_UP) ? -1 : 1;
+  if (current >= 0 && (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP)) {
+    current = (current + dir + E.search.list.count) % E.search.list.count;
   } else {
-    lastMatch = -1;
-    direction = 1;
-  }
-
-  if (lastMatch == -1) direction = 1;
-  int current = lastMatch;
-
-  for (int i = 0; i < E.nrows; i++) {
-    current += direction;
-    if (current == -1) {
-      current = E.nrows - 1;
-    } else if (current == E.nrows) {
-      current = 0;
-    }
-    erow* row = &E.row[current];
-    char* match = strstr(row->render, query);
-    if (match) {
-      lastMatch = current;
-      E.cy = current;
-      E.cx = renderToCharacter(row, match - row->render);
-      E.dy = E.nrows;
-
-      savedHlLine = current;
-      savedHl = malloc(row->rsize);
-      memcpy(savedHl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+    current = -1;
+    if (query[0] == '\0') return;
+
+    // Typing narrows the last query's matches and deleting searches again
+    const char* error = NULL;
+    if (E.search.query && E.search.regex == regex && strcmp(query, E.search.query) == 0) {
+      refreshIndex();
+    } else if (E.search.query && !regex && !E.search.regex && strncmp(query, E.search.query, strlen(E.search.query)) == 0) {
+      refreshIndex();
+      narrowIndex(query);
+    } else {
+      error = buildIndex(query, regex);
+    }
+    if (error) {
+      setStatusMessage("Regex: %s (%s)", query, error);
+      return;
+    }
+    if (E.search.list.count == 0) {
+      setStatusMessage("%s: %s (no matches)", regex ? "Regex" : "Search", query);
+      return;
     }
+    current = 0;
+  }
+  gotoMatch(current);
+
+  // Only the matched row needs its highlight, around the view for long rows
+  scroll();
+  erow* row = highlightRow(E.cy, syntaxState(E.cy));
+  savedHlLine = E.cy;
+  unsigned char* runs = rowRuns(row, &savedFrom, &savedTo);
+  size_t size = highlightSize(runs, savedFrom, savedTo);
+  savedHl = malloc(size);
+  memcpy(savedHl, runs, size);
+  overlayHighlight(row, E.cx, E.search.list.items[current].len, HL_MATCH);
+}
+
+// Find callback
+void findCallback(char* query, int key) {
+  searchCallback(query, key, 0);
+}
+
+// Regex find callback
+void regexCallback(char* query, int key) {
+  searchCallback(query, key, 1);
+}
+
+// Find next or previous match of the last query from the cursor
+void findAgain(int dir) {
+  if (E.search.query == NULL) {
+    setStatusMessage("No previous search");
+    return;
+  }
+  refreshIndex();
+  int count = E.search.list.count;
+  if (count == 0) {
+    setStatusMessage("%s: %s (no matches)", E.search.regex ? "Regex" : "Search", E.search.query);
+    return;
   }
+  int i = lowerMatch(E.cy, E.cx + (dir > 0));
+  if (dir < 0) i--;
+  gotoMatch((i + count) % count);
 }
 
-// Find query
-void find() {
+// Find literal or regex query
+void find(int regex) {
   int savedCx = E.cx;
   int savedCy = E.cy;
   int savedDx = E.dx;
   int savedDy = E.dy;
 
-  char* query = prompt("Search: %s (Use Esc/Arrows/Enter)", findCallback);
+  loadRows(INT_MAX);
+  char* query = regex ? prompt("Regex: %s (Use Esc/Arrows/Enter)", regexCallback) : prompt("Search: %s (Use Esc/Arrows/Enter)", findCallback);
   if (query) {
     free(query);
   } else {
@@ -731,12 +3737,21 @@ void find() {
 
 //// Buffer ////
 
+// Reserve room for appending to buffer, growing it by doubling
+void reserveBuffer(struct abuf* ab, int len) {
+  if (ab->len + len <= ab->capacity) return;
+  int capacity = ab->capacity ? ab->capacity : 64;
+  while (capacity < ab->len + len) capacity *= 2;
+  char* n = realloc(ab->b, capacity);
+  if (n == NULL) throw("realloc");
+  ab->b = n;
+  ab->capacity = capacity;
+}
+
 // Append buffer
 void appendBuffer(struct abuf* ab, const char* s, int len) {
-  char* n = realloc(ab->b, ab->len + len);
-  if (n == NULL) return;
-  memcpy(&n[ab->len], s, len);
-  ab->b = n;
+  reserveBuffer(ab, len);
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
@@ -747,33 +3762,127 @@ void freeBuffer(struct abuf* ab) {
 
 //// Output ////
 
-// Refresh config
-void refreshConfig() {
-  if (getTime()->tm_sec == 0) refreshScreen();
-  if (time(NULL) - E.cursorTime > 1) {
-    E.cursor = (E.cursor + 1) % 2;
-    E.cursorTime = time(NULL);
-    refreshScreen();
-  }
-}
-
 // Set editor scroll
 void scroll() {
   E.rx = 0;
-  if (E.cy < E.nrows) E.rx = characterToRender(&E.row[E.cy], E.cx);
+  if (E.cy < E.nrows) E.rx = characterToRender(getRow(E.cy), E.cx);
 
   if (E.rx < E.dx) E.dx = E.rx;
   if (E.rx >= E.dx + E.cols) E.dx = E.rx - E.cols + 1;
   if (E.cy < E.dy) E.dy = E.cy;
   if (E.cy >= E.dy + E.rows) E.dy = E.cy - E.rows + 1;
+  loadRows(E.dy + E.rows);
+}
+
+// Keep the view on the cursor and schedule a frame to be drawn before
+// waiting for more input
+void scheduleRefresh() {
+  scroll();
+  E.redraw = 1;
+}
+
+// Refresh config
+void refreshConfig() {
+  time_t now = time(NULL);
+  if (now / 60 != E.clockTime / 60) {
+    E.clockTime = now;
+    scheduleRefresh();
+  }
+  if (now - E.cursorTime > 1) {
+    E.cursor = (E.cursor + 1) % 2;
+    E.cursorTime = now;
+    scheduleRefresh();
+  }
+}
+
+// Resize cell grids to the window, the next frame is drawn in full
+void resizeGrid() {
+  if (E.gridRows == E.rows + 2 && E.gridCols == E.cols) return;
+  E.gridRows = E.rows + 2;
+  E.gridCols = E.cols;
+  free(E.screen);
+  free(E.frame);
+  E.screen = malloc(sizeof(cell) * E.gridRows * E.gridCols);
+  E.frame = malloc(sizeof(cell) * E.gridRows * E.gridCols);
+  E.gridStale = 1;
+
+  // A full redraw with a few color changes per row fits without growing
+  reserveBuffer(&E.out, E.gridRows * (E.gridCols + 64));
+}
+
+// Fill cells with blanks
+void clearCells(cell* cells, int n) {
+  for (int i = 0; i < n; i++) cells[i] = (cell){ " ", 0 };
+}
+
+// Put UTF-8 text into frame row, a character to a cell. Bytes that do not
+// form a whole character are shown as '?', except stray continuation bytes,
+// which take no column.
+int putText(int y, int x, const char* s, int len, unsigned char attr) {
+  cell* row = &E.frame[y * E.gridCols];
+  int i = 0;
+  while (i < len && x < E.gridCols) {
+    unsigned char b = s[i];
+    int n = b < 0x80 ? 1 : b < 0xc0 ? 0 : b < 0xe0 ? 2 : b < 0xf0 ? 3 : b < 0xf8 ? 4 : -1;
+    if (n == 0) {
+      i++;
+      continue;
+    }
+    int k = 1;
+    while (k < n && i + k < len && isContinuation(s[i + k])) k++;
+    row[x] = (cell){ "?", attr };
+    if (k == n) memcpy(row[x].c, &s[i], n);
+    x++;
+    i += k;
+  }
+  return x;
+}
+
+// Draw row characters from one index to another with attribute, from
+// render column rx, and return the column after them. Tabs expand to
+// spaces and control characters are shown inverted in the last color.
+int drawRun(int y, erow* row, int from, int to, int attr, int rx, int* color) {
+  int end = E.dx + E.cols;
+  int j = from;
+  while (j < to && rx < end) {
+    char c = row->chars[j];
+    if (c == '\t') {
+      for (int w = TAB_STOP - rx % TAB_STOP; w > 0; w--, rx++) {
+        if (rx >= E.dx && rx < end) putText(y, rx - E.dx, " ", 1, attr);
+      }
+      *color = attr;
+      j++;
+    } else if (iscntrl(c)) {
+      char sym = (c <= 26) ? '@' + c : '?';
+      if (rx >= E.dx) putText(y, rx - E.dx, &sym, 1, CELL_INVERSE | *color);
+      rx++;
+      j++;
+    } else {
+      // Plain text is put as a whole, clipped to the view, along with the
+      // rest of a character split by the end of the run. Characters left of
+      // the view are skipped, as is the rest of one drawn by the last run.
+      int k = j;
+      while (k < to && row->chars[k] != '\t' && !iscntrl(row->chars[k])) k++;
+      while (k < row->size && isContinuation(row->chars[k])) k++;
+      while (j < k && (rx < E.dx || isContinuation(row->chars[j]))) rx += !isContinuation(row->chars[j++]);
+      if (j < k) rx = E.dx + putText(y, rx - E.dx, &row->chars[j], k - j, attr);
+      *color = attr;
+      j = k;
+    }
+  }
+  return rx;
 }
 
 // Draw editor layout
-void drawLayout(struct abuf* ab) {
-  for (int j = 0; j < E.rows; j++) {
-    int filerow = j + E.dy;
+void drawLayout() {
+  // Only rows in view are highlighted, starting from the state above them,
+  // and changes beyond the view are left to propagate when idle
+  propagateSyntax(E.dy + E.rows, INT_MAX);
+  int state = syntaxState(E.dy);
+  for (int y = 0; y < E.rows; y++) {
+    int filerow = y + E.dy;
     if (filerow >= E.nrows) {
-      if (E.nrows == 0 && j == E.rows / 3) {
+      if (E.nrows == 0 && y == E.rows / 3) {
         // Setup title
         char welcome[80];
         int len = snprintf(welcome, sizeof(welcome), "Geode: Minimal code editor -- version %s", VERSION);
@@ -781,116 +3890,266 @@ void drawLayout(struct abuf* ab) {
 
         // Add padding to title
         int padding = (E.cols - len) / 2;
-        if (padding) {
-          appendBuffer(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) {
-          appendBuffer(ab, " ", 1);
-        }
-
-        // Append
-        appendBuffer(ab, welcome, len);
+        if (padding) putText(y, 0, "~", 1, 0);
+        putText(y, padding, welcome, len, 0);
       } else {
-        appendBuffer(ab, "~", 1);
+        putText(y, 0, "~", 1, 0);
       }
     } else {
-      int len = E.row[filerow].rsize - E.dx;
-      if (len < 0) len = 0;
-      if (len > E.cols) len = E.cols;
-
-      char* c = &E.row[filerow].render[E.dx];
-      unsigned char* hl = &E.row[filerow].hl[E.dx];
-      int currentColor = -1;
-      for (int j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          appendBuffer(ab, "\x1b[7m", 4);
-          appendBuffer(ab, &sym, 1);
-          appendBuffer(ab, "\x1b[m", 3);
-          if (currentColor != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColor);
-            appendBuffer(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (currentColor != -1) {
-            appendBuffer(ab, "\x1b[39m", 5);
-            currentColor = -1;
-          }
-          appendBuffer(ab, &c[j], 1);
-        } else {
-          int color = syntaxToColor(hl[j]);
-          if (color != currentColor) {
-            currentColor = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            appendBuffer(ab, buf, clen);
-          }
-          appendBuffer(ab, &c[j], 1);
-        }
+      erow* row = highlightRow(filerow, state);
+      state = row->hlOpenComment;
+
+      // Each highlight run is drawn with one attribute
+      int from, to;
+      unsigned char* p = rowRuns(row, &from, &to);
+      int color = 0;
+      int rx = characterToRender(row, from);
+      for (int j = from, hl, len; j < to && rx < E.dx + E.cols; j += len) {
+        p = getRun(p, &hl, &len);
+        rx = drawRun(y, row, j, j + len, hl == HL_NORMAL ? 0 : syntaxToColor(hl), rx, &color);
       }
-      appendBuffer(ab, "\x1b[39m", 5);
     }
-
-    appendBuffer(ab, "\x1b[K", 3);
-    appendBuffer(ab, "\r\n", 2);
   }
 }
 
 // Draw status bar
-void drawStatusBar(struct abuf* ab) {
-  appendBuffer(ab, "\x1b[7m", 4);
+void drawStatusBar() {
   char status[80], rstatus[80];
   char* dirty = E.dirty ? "(modified)" : "";
   char* ftype = E.syntax ? E.syntax->filetype : "*";
   char* fsize = displayFileSize();
   char* insert = E.insert ? "SUB" : "INS";
   struct tm* ti = getTime();
-  int len = snprintf(status, sizeof(status), " %.20s - %d lines %s", E.filename ? E.filename : "[untitled]", E.nrows, dirty);
+  char* more = E.indexed < E.originalSize ? "+" : "";
+  char* name = E.filename ? E.filename : "[untitled]";
+  int len = snprintf(status, sizeof(status), " %.20s - %d%s lines, %zu%s chars %s", name, E.nrows, more, E.nchars, more, dirty);
   int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %s | %d:%d | %s | %02d:%02d ", ftype, fsize, E.cy + 1, E.cx + 1, insert, ti->tm_hour, ti->tm_min);
+  if (len + rlen > E.cols) len = snprintf(status, sizeof(status), " %.20s - %d%s lines %s", name, E.nrows, more, dirty);
 
   if (len > E.cols) len = E.cols;
-  appendBuffer(ab, status, len);
-  while (len < E.cols) {
-    if (E.cols - len == rlen) {
-      appendBuffer(ab, rstatus, rlen);
-      break;
-    } else {
-      appendBuffer(ab, " ", 1);
-      len++;
-    }
+  int x = putText(E.rows, 0, status, len, CELL_INVERSE);
+  if (E.cols - len >= rlen) {
+    while (x < E.cols - rlen) x = putText(E.rows, x, " ", 1, CELL_INVERSE);
+    putText(E.rows, x, rstatus, rlen, CELL_INVERSE);
+  } else {
+    while (x < E.cols) x = putText(E.rows, x, " ", 1, CELL_INVERSE);
   }
-  appendBuffer(ab, "\x1b[m", 3);
-  appendBuffer(ab, "\r\n", 2);
 }
 
 // Draw message bar
-void drawMessageBar(struct abuf* ab) {
-  appendBuffer(ab, "\x1b[K", 3);
+void drawMessageBar() {
   int len = strlen(E.message);
   if (len > E.cols) len = E.cols;
-  if (len && time(NULL) - E.messageTime < 5) appendBuffer(ab, E.message, len);
+  if (len && time(NULL) - E.messageTime < 5) putText(E.rows + 1, 0, E.message, len, 0);
 }
 
-// Refresh screen
-void refreshScreen() {
-  struct abuf ab = ABUF_INIT;
-  scroll();
-  appendBuffer(&ab, "\x1b[?25l", 6);
-  appendBuffer(&ab, "\x1b[H", 3);
+// Move terminal cursor with the shortest escape sequence
+void moveTerminal(struct abuf* ab, int y, int x) {
+  if (E.termY == y && E.termX == x) return;
+  char buf[32], alt[32];
+  int len = (y == 0 && x == 0) ? snprintf(buf, sizeof(buf), "\x1b[H") : snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+
+  // Relative moves need a known position
+  if (E.termX >= 0 && E.termY >= 0) {
+    int alen = 0;
+    if (y == E.termY && x == 0) alen = snprintf(alt, sizeof(alt), "\r");
+    else if (y == E.termY + 1 && x == 0) alen = snprintf(alt, sizeof(alt), "\r\n");
+    else if (y == E.termY && x > E.termX) alen = snprintf(alt, sizeof(alt), "\x1b[%dC", x - E.termX);
+    else if (y == E.termY) alen = snprintf(alt, sizeof(alt), "\x1b[%dD", E.termX - x);
+    if (alen && alen < len) {
+      memcpy(buf, alt, alen);
+      len = alen;
+    }
+  }
+  appendBuffer(ab, buf, len);
+  E.termY = y;
+  E.termX = x;
+}
+
+// Get cell attribute from its index in the escape table
+int sgrAttr(int i) {
+  int color = i % 9;
+  return (i >= 9 ? CELL_INVERSE : 0) | (color ? color + 29 : 0);
+}
+
+// Get index of cell attribute in the escape table
+int sgrIndex(unsigned char attr) {
+  int color = attr & ~CELL_INVERSE;
+  return ((attr & CELL_INVERSE) ? 9 : 0) + (color ? color - 29 : 0);
+}
+
+// Encode escapes between every pair of attributes, which are the
+// highlight colors with or without inverse
+void buildSgrTable() {
+  for (int i = 0; i < SGR_ATTRS; i++) {
+    for (int j = 0; j < SGR_ATTRS; j++) {
+      int from = sgrAttr(i), to = sgrAttr(j);
+      struct sgr* e = &sgrTable[i][j];
+      e->len = 0;
+      if (from == to) continue;
+      char* buf = e->s;
+      int len = sprintf(buf, "\x1b[");
+      if ((from ^ to) & CELL_INVERSE) len += sprintf(&buf[len], (to & CELL_INVERSE) ? "7" : "27");
+      int color = to & ~CELL_INVERSE;
+      if (color != (from & ~CELL_INVERSE)) {
+        if (len > 2) buf[len++] = ';';
+        len += sprintf(&buf[len], "%d", color ? color : 39);
+      }
+      buf[len++] = 'm';
+      e->len = len;
+    }
+  }
+}
+
+// Set terminal attributes with the changed parameters only
+void setTerminalAttr(struct abuf* ab, unsigned char attr) {
+  if (E.termAttr == attr) return;
+  struct sgr* e = &sgrTable[sgrIndex(E.termAttr)][sgrIndex(attr)];
+  appendBuffer(ab, e->s, e->len);
+  E.termAttr = attr;
+}
+
+// Check if cells look the same
+int sameCell(cell a, cell b) {
+  return memcmp(a.c, b.c, sizeof(a.c)) == 0 && a.attr == b.attr;
+}
 
-  drawLayout(&ab);
-  drawStatusBar(&ab);
-  drawMessageBar(&ab);
+// Scroll text rows on the terminal when the view moved vertically and
+// most rows kept their content, so that only the exposed rows are drawn
+void scrollGrid(struct abuf* ab) {
+  int d = E.dy - E.screenDy;
+  int cols = E.gridCols;
+  int n = E.rows - abs(d);
+  if (d == 0 || n <= 0) return;
+
+  int same = 0;
+  for (int y = 0; y < n; y++) {
+    cell* new = &E.frame[(d > 0 ? y : y - d) * cols];
+    cell* old = &E.screen[(d > 0 ? y + d : y) * cols];
+    int x = 0;
+    while (x < cols && sameCell(new[x], old[x])) x++;
+    same += (x == cols);
+  }
+  if (same * 2 < n) return;
 
+  // Scroll within the text rows, which moves the cursor home, with blank
+  // rows coming in without attributes
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.dy) + 1, (E.rx - E.dx) + 1);
-  appendBuffer(&ab, buf, strlen(buf));
-  appendBuffer(&ab, E.cursor ? "\x1b[?25h" : "\x1b[?25l", 6);
+  setTerminalAttr(ab, 0);
+  appendBuffer(ab, buf, snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.rows));
+  appendBuffer(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%d%c", abs(d), d > 0 ? 'S' : 'T'));
+  appendBuffer(ab, "\x1b[r", 3);
+  E.termX = E.termY = 0;
+
+  cell* from = &E.screen[(d > 0 ? d : 0) * cols];
+  cell* to = &E.screen[(d > 0 ? 0 : -d) * cols];
+  memmove(to, from, sizeof(cell) * n * cols);
+  clearCells(&E.screen[(d > 0 ? n : 0) * cols], abs(d) * cols);
+}
+
+// Emit the differences between the frame and the screen
+void flushGrid(struct abuf* ab) {
+  int cols = E.gridCols;
+  if (E.gridStale) {
+    appendBuffer(ab, "\x1b[m\x1b[2J", 7);
+    clearCells(E.screen, E.gridRows * cols);
+    E.termAttr = 0;
+    E.termX = E.termY = -1;
+    E.gridStale = 0;
+  } else {
+    scrollGrid(ab);
+  }
+  E.screenDy = E.dy;
+
+  for (int y = 0; y < E.gridRows; y++) {
+    cell* new = &E.frame[y * cols];
+    cell* old = &E.screen[y * cols];
+
+    // Blank tail of the row is erased in one go when anything there changed
+    int tail = cols;
+    while (tail > 0 && sameCell(new[tail - 1], (cell){ " ", 0 })) tail--;
+    int erase = 0;
+    for (int x = tail; x < cols && !erase; x++) erase = !sameCell(new[x], old[x]);
+    int limit = erase ? tail : cols;
+
+    // Changed spans, joining spans separated by a few unchanged cells
+    int x = 0;
+    while (x < limit) {
+      if (sameCell(new[x], old[x])) {
+        x++;
+        continue;
+      }
+      int last = x;
+      for (int k = x + 1; k < limit && k - last <= CELL_GAP; k++) {
+        if (!sameCell(new[k], old[k])) last = k;
+      }
+      moveTerminal(ab, y, x);
+      while (x <= last) {
+        setTerminalAttr(ab, new[x].attr);
+        int end = x;
+        while (end <= last && new[end].attr == new[x].attr) end++;
+        reserveBuffer(ab, (end - x) * sizeof(new[x].c));
+        for (; x < end; x++) {
+          int n = 1;
+          while (n < (int)sizeof(new[x].c) && new[x].c[n]) n++;
+          memcpy(&ab->b[ab->len], new[x].c, n);
+          ab->len += n;
+        }
+      }
+      // Writing the last column leaves the cursor pending a wrap
+      E.termX = x < cols ? x : -1;
+    }
+
+    if (erase) {
+      moveTerminal(ab, y, tail);
+      setTerminalAttr(ab, 0);
+      appendBuffer(ab, "\x1b[K", 3);
+    }
+  }
+
+  memcpy(E.screen, E.frame, sizeof(cell) * E.gridRows * cols);
+}
+
+// Refresh screen. While the terminal is still taking the last frame, the
+// redraw waits, so that frames in between are skipped rather than queued.
+void refreshScreen() {
+  if (outputPending()) return;
+  E.redraw = 0;
+  scroll();
+  resizeGrid();
+  clearCells(E.frame, E.gridRows * E.gridCols);
+  drawLayout();
+  drawStatusBar();
+  drawMessageBar();
+
+  // The frame is built in a buffer kept across frames, leaving room in
+  // front to begin a synchronized update and to hide the cursor while
+  // cells change under it
+  struct abuf* ab = &E.out;
+  int start = 14;
+  ab->len = 0;
+  reserveBuffer(ab, start);
+  ab->len = start;
+  flushGrid(ab);
+  if (ab->len > 14 && E.termCursor != 0) {
+    start -= 6;
+    memcpy(&ab->b[start], "\x1b[?25l", 6);
+    E.termCursor = 0;
+  }
+
+  moveTerminal(ab, E.cy - E.dy, E.rx - E.dx);
+  if (E.termCursor != E.cursor) {
+    appendBuffer(ab, E.cursor ? "\x1b[?25h" : "\x1b[?25l", 6);
+    E.termCursor = E.cursor;
+  }
+  if (ab->len == 14) return;
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  freeBuffer(&ab);
+  if (E.syncOutput) {
+    start -= 8;
+    memcpy(&ab->b[start], "\x1b[?2026h", 8);
+    appendBuffer(ab, "\x1b[?2026l", 8);
+  }
+  queueOutput(start);
 }
 
 // Set status message
@@ -900,6 +4159,7 @@ void setStatusMessage(const char* fmt, ...) {
   vsnprintf(E.message, sizeof(E.message), fmt, ap);
   va_end(ap);
   E.messageTime = time(NULL);
+  scheduleRefresh();
 }
 
 //// Input ////
@@ -910,11 +4170,9 @@ char* prompt(char* prompt, void (*callback)(char*, int)) {
   char* buf = malloc(size);
   size_t len = 0;
   buf[0] = '\0';
+  setStatusMessage(prompt, buf);
 
   while (1) {
-    setStatusMessage(prompt, buf);
-    refreshScreen();
-
     int c = readKey();
     if (c == DELETE || c == CTRL_KEY('h') || c == BACKSPACE) {
       if (len != 0) buf[--len] = '\0';
@@ -934,22 +4192,39 @@ char* prompt(char* prompt, void (*callback)(char*, int)) {
       }
       buf[len++] = c;
       buf[len] = '\0';
+    } else if (c == PASTE) {
+      // Pasted text is added up to the first line break
+      struct abuf ab = ABUF_INIT;
+      readPaste(&ab);
+      for (int i = 0; i < ab.len && ab.b[i] != '\r' && ab.b[i] != '\n'; i++) {
+        if ((unsigned char)ab.b[i] >= 128 || iscntrl(ab.b[i])) continue;
+        if (len == size - 1) {
+          size *= 2;
+          buf = realloc(buf, size);
+        }
+        buf[len++] = ab.b[i];
+        buf[len] = '\0';
+      }
+      freeBuffer(&ab);
     }
 
+    // Callback may replace the message, e.g. to show search results
+    setStatusMessage(prompt, buf);
     if (callback) callback(buf, c);
   }
 }
 
 // Move cursor
 void moveCursor(int key) {
-  erow* row = (E.cy >= E.nrows) ? NULL : &E.row[E.cy];
+  loadRows(E.cy + 2);
+  erow* row = getRow(E.cy);
   switch (key) {
     case ARROW_LEFT:
       if (E.cx != 0) {
         E.cx--;
       } else if (E.cy > 0) {
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = getRow(E.cy)->size;
       }
       break;
 
@@ -975,7 +4250,7 @@ void moveCursor(int key) {
       break;
   }
 
-  row = (E.cy >= E.nrows) ? NULL : &E.row[E.cy];
+  row = getRow(E.cy);
   int len = row ? row->size : 0;
   if (E.cx > len) E.cx = len;
   resetCursor();
@@ -985,6 +4260,7 @@ void moveCursor(int key) {
 void processKey() {
   static int qt = QUIT_CONFIRM;
   int c = readKey();
+  scheduleRefresh();
 
   switch (c) {
     // [←][↑][→][↓] move cursor
@@ -998,7 +4274,7 @@ void processKey() {
     // [Home][End] move cursor to left or right edges
     case HOME:
     case END:
-      E.cx = c == HOME ? 0 : E.row[E.cy].size;
+      E.cx = (c == HOME || E.cy >= E.nrows) ? 0 : getRow(E.cy)->size;
       break;
 
     // [PageUp][PageDown] move cursor to top or bottom edges
@@ -1022,6 +4298,16 @@ void processKey() {
       insertLine();
       break;
 
+    // Bracketed paste
+    case PASTE:
+      {
+        struct abuf ab = ABUF_INIT;
+        readPaste(&ab);
+        insertText(ab.b, ab.len);
+        freeBuffer(&ab);
+      }
+      break;
+
     // Insert mode
     case INSERT:
       E.insert = (E.insert + 1) % 2;
@@ -1037,7 +4323,18 @@ void processKey() {
 
     // [Ctrl-F] find query
     case CTRL_KEY('f'):
-      find();
+      find(0);
+      break;
+
+    // [Ctrl-R] find regex
+    case CTRL_KEY('r'):
+      find(1);
+      break;
+
+    // [Ctrl-N][Ctrl-P] find next or previous match of last query
+    case CTRL_KEY('n'):
+    case CTRL_KEY('p'):
+      findAgain(c == CTRL_KEY('n') ? 1 : -1);
       break;
 
     // [Ctrl-Q] exit editor
@@ -1047,6 +4344,8 @@ void processKey() {
         qt--;
         return;
       }
+      finishSave();
+      drainOutput();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -1081,16 +4380,47 @@ void setupEditor() {
   E.dx = 0;
   E.dy = 0;
   E.nrows = 0;
-  E.row = NULL;
+  E.tree = NULL;
+  E.original = NULL;
+  E.originalSize = 0;
+  E.originalMapped = 0;
+  E.originalFd = -1;
+  E.originalLost = 0;
+  E.pageSize = sysconf(_SC_PAGESIZE);
+  E.nbytes = 0;
+  E.nchars = 0;
   E.filename = NULL;
   E.dirty = 0;
   E.insert = 0;
   E.message[0] = '\0';
   E.messageTime = 0;
   E.syntax = NULL;
-
-  if (getWindowSize(&E.rows, &E.cols) == -1) throw("getWindowSize");
-  E.rows -= 2;
+  E.syntaxFrom = -1;
+  E.spans = (struct spanList){ NULL, 0, 0 };
+  E.screen = NULL;
+  E.frame = NULL;
+  E.gridRows = E.gridCols = 0;
+  E.termCursor = -1;
+  E.screenDy = 0;
+  E.out = (struct abuf){ NULL, 0, 0 };
+  E.pending = (struct abuf){ NULL, 0, 0 };
+  E.pendingPos = 0;
+  E.syncOutput = 0;
+  E.save = NULL;
+  E.search.query = NULL;
+  E.search.regex = 0;
+  E.search.re.prog = NULL;
+  E.search.list = (struct matchList){ NULL, 0, 0 };
+  E.search.ndirty = 0;
+  E.search.stale = 0;
+  memset(&E.arena, 0, sizeof(E.arena));
+  E.clockTime = time(NULL);
+  buildSgrTable();
+
+  setupEvents();
+  setupOutput();
+  updateWindowSize();
+  E.redraw = 1;
 }
 
 // Main function
@@ -1099,13 +4429,10 @@ int main(int argc, char* argv[]) {
   enableRawMode();
   setupEditor();
   if (argc >= 2) openFile(argv[1]);
-  setStatusMessage("HELP: Ctrl-F = find | Ctrl-H = backspace | Ctrl-Q = quit | Ctrl-S = save");
+  setStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = regex find | Ctrl-N/Ctrl-P = next/previous match | Ctrl-H = backspace");
 
   // Iterate loop
-  while (1) {
-    refreshScreen();
-    processKey();
-  }
+  while (1) processKey();
 
   // Return
   return 0;